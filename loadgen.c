@@ -0,0 +1,716 @@
+/*
+ * Load generator for the robot server. Simulates robots which speak the
+ * full protocol: log in, walk a grid with random obstacles as the server
+ * commands and hand over the secret message. Reports sessions per second,
+ * commands per session and per-command latency percentiles.
+ *
+ * Build: gcc -O2 -Wall -pthread -o loadgen loadgen.c
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+
+// Protocol, must match server.c
+#define SERVER_MOVE "102 MOVE"
+#define SERVER_TURN_LEFT "103 TURN LEFT"
+#define SERVER_TURN_RIGHT "104 TURN RIGHT"
+#define SERVER_PICK_UP "105 GET MESSAGE"
+#define SERVER_LOGOUT "106 LOGOUT"
+#define SERVER_KEY_REQUEST "107 KEY REQUEST"
+#define SERVER_OK "200 OK"
+
+#define NKEYS 5
+
+// Same as authentification_keys in server.c
+struct {
+	int server_key;
+	int client_key;
+} authentification_keys[NKEYS] = {
+	{ 23019, 32037 },
+	{ 32037, 29295 },
+	{ 18789, 13603 },
+	{ 16443, 29533 },
+	{ 18189, 21952 },
+};
+
+#define SERVER_PORT 5555
+#define MAX_EVENTS 256
+#define MAX_OBSTACLES 64
+#define MAX_COMMANDS 1000 // session is failed if server needs more
+#define REPLY_MAXLEN 64
+#define MAX_PIPELINE 32
+
+// Robot waits for
+#define EXPECT_CONNECT 0
+#define EXPECT_KEY_REQUEST 1
+#define EXPECT_SERVER_CONFIRMATION 2
+#define EXPECT_SERVER_OK 3
+#define EXPECT_COMMAND 4
+#define EXPECT_LOGOUT 5
+
+// Heading, turning right adds 1
+int dir_dx[4] = { 0, 1, 0, -1 };
+int dir_dy[4] = { 1, 0, -1, 0 };
+
+struct robot {
+	int fd;
+	int state;
+	int keyid;
+	int hash;
+	int x;
+	int y;
+	int dir;
+	int commands;
+	int ahead; // OK messages sent before the command they answer (-k)
+	int nobstacles;
+	int obstacles[MAX_OBSTACLES][2];
+	char name[20];
+	char reply[REPLY_MAXLEN];
+	int reply_len;
+	long long sent_ns; // when the message being answered was sent
+};
+
+/*
+ * Latency histogram. Values below 2 * HIST_SUB ns are counted exactly,
+ * above that each power of 2 is split in HIST_SUB buckets, so relative
+ * error stays below 1 / HIST_SUB
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct histogram {
+	unsigned long long counts[HIST_BUCKETS];
+	unsigned long long total;
+};
+
+int hist_bucket(unsigned long long v) {
+	int shift;
+
+	if (v < 2 * HIST_SUB) {
+		return v;
+	}
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (v >> shift) - HIST_SUB;
+}
+
+// Highest value counted in bucket \i
+unsigned long long hist_value(int i) {
+	int shift;
+
+	if (i < 2 * HIST_SUB) {
+		return i;
+	}
+	shift = i / HIST_SUB - 1;
+	return ((unsigned long long)(i % HIST_SUB + HIST_SUB + 1) << shift) - 1;
+}
+
+void hist_add(struct histogram* h, unsigned long long v) {
+	h->counts[hist_bucket(v)]++;
+	h->total++;
+}
+
+unsigned long long hist_percentile(struct histogram* h, double p) {
+	unsigned long long rank = (unsigned long long)(h->total * p / 100.0);
+	unsigned long long seen = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen > rank) {
+			return hist_value(i);
+		}
+	}
+	return 0;
+}
+
+struct worker {
+	int id;
+	int nrobots;
+	pthread_t thread;
+	unsigned long long rng;
+	unsigned long long sessions;
+	unsigned long long failed;
+	unsigned long long commands;
+	struct histogram latency;
+};
+
+struct sockaddr_storage server_addr; // AF_INET or AF_UNIX (-u)
+socklen_t server_addrlen;
+int concurrency = 100;
+int nthreads = 1;
+long long nsessions = 10000;
+int max_obstacles = 24;
+int grid = 10; // robot starts within [-grid, grid] on both axes
+int pipeline = 0; // OK messages robot sends ahead of commands
+atomic_llong sessions_started;
+
+long long now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+unsigned int rng_next(struct worker* w) {
+	// xorshift64
+	w->rng ^= w->rng << 13;
+	w->rng ^= w->rng >> 7;
+	w->rng ^= w->rng << 17;
+	return w->rng >> 32;
+}
+
+int rng_range(struct worker* w, int lo, int hi) {
+	return lo + rng_next(w) % (hi - lo + 1);
+}
+
+_Bool is_obstacle(struct robot* r, int x, int y) {
+	int i;
+
+	for (i = 0; i < r->nobstacles; i++) {
+		if (r->obstacles[i][0] == x && r->obstacles[i][1] == y) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Can robot of \r get from its position to (0, 0). Obstacles are within
+// the grid, so the search is limited to the grid and a free ring around
+// it
+_Bool is_reachable(struct robot* r) {
+	int side = 2 * grid + 3;
+	int* queue;
+	char* seen;
+	int head = 0;
+	int tail = 0;
+	_Bool found = false;
+	int i;
+
+	queue = malloc(side * side * sizeof(queue[0]));
+	seen = calloc(side * side, 1);
+	if (queue == NULL || seen == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	queue[tail++] = (r->y + grid + 1) * side + r->x + grid + 1;
+	seen[queue[0]] = 1;
+	while (head < tail) {
+		int x = queue[head] % side - grid - 1;
+		int y = queue[head] / side - grid - 1;
+
+		head++;
+		if (x == 0 && y == 0) {
+			found = true;
+			break;
+		}
+		for (i = 0; i < 4; i++) {
+			int nx = x + dir_dx[i];
+			int ny = y + dir_dy[i];
+			int c = (ny + grid + 1) * side + nx + grid + 1;
+
+			if (nx < -grid - 1 || nx > grid + 1 || ny < -grid - 1 || ny > grid + 1 ||
+			    seen[c] || is_obstacle(r, nx, ny)) {
+				continue;
+			}
+			seen[c] = 1;
+			queue[tail++] = c;
+		}
+	}
+	free(queue);
+	free(seen);
+	return found;
+}
+
+int get_hash(char* name) {
+	int hash = 0;
+
+	for (; *name; name++) {
+		hash += (unsigned char)*name;
+	}
+	return (hash * 1000) % 65536;
+}
+
+// Send \msg with terminator, message is short enough to always fit
+// return 0 on success
+//        -1 on error
+int robot_send(struct robot* r, char* msg) {
+	char buf[REPLY_MAXLEN + 2];
+	int len = strlen(msg);
+
+	memcpy(buf, msg, len);
+	buf[len++] = '\a';
+	buf[len++] = '\b';
+	r->sent_ns = now_ns();
+	if (send(r->fd, buf, len, MSG_NOSIGNAL) != len) {
+		return -1;
+	}
+	return 0;
+}
+
+// Place robot on a new grid and connect
+// return 0 on success
+//        -1 on error
+int robot_start(struct worker* w, struct robot* r, int epoll_fd) {
+	struct epoll_event ev;
+	int n;
+	int one = 1;
+
+	// Obstacles may wall the robot or (0, 0) in, such a grid is
+	// replaced, the server could not finish the session
+	do {
+		r->nobstacles = 0;
+		n = rng_range(w, 0, max_obstacles);
+		while (r->nobstacles < n) {
+			int x = rng_range(w, -grid, grid);
+			int y = rng_range(w, -grid, grid);
+
+			if ((x != 0 || y != 0) && !is_obstacle(r, x, y)) {
+				r->obstacles[r->nobstacles][0] = x;
+				r->obstacles[r->nobstacles][1] = y;
+				r->nobstacles++;
+			}
+		}
+		// Robot which pipelines answers PICK UP with OK, it must not
+		// start at (0, 0)
+		do {
+			r->x = rng_range(w, -grid, grid);
+			r->y = rng_range(w, -grid, grid);
+		} while (is_obstacle(r, r->x, r->y) ||
+			 (pipeline != 0 && r->x == 0 && r->y == 0));
+	} while (!is_reachable(r));
+	r->dir = rng_range(w, 0, 3);
+	r->keyid = rng_range(w, 0, NKEYS - 1);
+	snprintf(r->name, sizeof(r->name), "robot%u", rng_next(w));
+	r->hash = get_hash(r->name);
+	r->state = EXPECT_CONNECT;
+	r->commands = 0;
+	r->ahead = 0;
+	r->reply_len = 0;
+
+	r->fd = socket(server_addr.ss_family, SOCK_STREAM, 0);
+	if (r->fd == -1) {
+		perror("socket");
+		return -1;
+	}
+	if (server_addr.ss_family == AF_INET) {
+		setsockopt(r->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	if (fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) | O_NONBLOCK) == -1) {
+		perror("fcntl");
+		close(r->fd);
+		return -1;
+	}
+	// Connect in background so a slow accept does not stall other robots
+	if (connect(r->fd, (struct sockaddr*)&server_addr, server_addrlen) == -1 &&
+	    errno != EINPROGRESS) {
+		perror("connect");
+		close(r->fd);
+		return -1;
+	}
+	ev.events = EPOLLOUT;
+	ev.data.ptr = r;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, r->fd, &ev) == -1) {
+		perror("epoll_ctl");
+		close(r->fd);
+		return -1;
+	}
+	return 0;
+}
+
+// Log in and answer the first \pipeline commands without waiting for
+// them, all by a single send(). Robot stays where it is until it has
+// caught up, so every early answer reports the start position
+// return 0 on success
+//        -1 on error
+int robot_pipeline(struct robot* r) {
+	char buf[3 * REPLY_MAXLEN + MAX_PIPELINE * 32];
+	int len;
+	int i;
+
+	len = sprintf(buf, "%s\a\b%d\a\b%d\a\b", r->name, r->keyid,
+		      (r->hash + authentification_keys[r->keyid].client_key) % 65536);
+	for (i = 0; i < pipeline; i++) {
+		len += sprintf(buf + len, "OK %d %d\a\b", r->x, r->y);
+	}
+	r->ahead = pipeline;
+	r->sent_ns = now_ns();
+	if (send(r->fd, buf, len, MSG_NOSIGNAL) != len) {
+		return -1;
+	}
+	return 0;
+}
+
+// Connection is ready: wait for replies from now on and log in
+// return 0 on success
+//        -1 on error
+int robot_connected(struct robot* r, int epoll_fd) {
+	struct epoll_event ev;
+	socklen_t len = sizeof(int);
+	int err;
+
+	if (getsockopt(r->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+		return -1;
+	}
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = r;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, r->fd, &ev) == -1) {
+		return -1;
+	}
+	r->state = EXPECT_KEY_REQUEST;
+	if (pipeline != 0) {
+		return robot_pipeline(r);
+	}
+	return robot_send(r, r->name);
+}
+
+// React to a server message \msg
+// return 0 to go on
+//        1 when session is over
+//        -1 on protocol violation
+int robot_step(struct worker* w, struct robot* r, char* msg) {
+	char buf[REPLY_MAXLEN];
+	int nx;
+	int ny;
+
+	switch (r->state) {
+	case EXPECT_KEY_REQUEST:
+		if (strcmp(msg, SERVER_KEY_REQUEST) != 0) {
+			return -1;
+		}
+		r->state = EXPECT_SERVER_CONFIRMATION;
+		if (pipeline != 0) {
+			return 0;
+		}
+		snprintf(buf, sizeof(buf), "%d", r->keyid);
+		return robot_send(r, buf);
+	case EXPECT_SERVER_CONFIRMATION:
+		if (atoi(msg) != (r->hash + authentification_keys[r->keyid].server_key) % 65536) {
+			return -1;
+		}
+		r->state = EXPECT_SERVER_OK;
+		if (pipeline != 0) {
+			return 0;
+		}
+		snprintf(buf, sizeof(buf), "%d", (r->hash + authentification_keys[r->keyid].client_key) % 65536);
+		return robot_send(r, buf);
+	case EXPECT_SERVER_OK:
+		if (strcmp(msg, SERVER_OK) != 0) {
+			return -1;
+		}
+		// First command follows without a request
+		r->state = EXPECT_COMMAND;
+		return 0;
+	case EXPECT_COMMAND:
+		if (++r->commands > MAX_COMMANDS) {
+			return -1;
+		}
+		if (strcmp(msg, SERVER_MOVE) == 0) {
+			if (r->ahead > 0) {
+				// Already answered as if blocked
+				r->ahead--;
+				return 0;
+			}
+			nx = r->x + dir_dx[r->dir];
+			ny = r->y + dir_dy[r->dir];
+			if (!is_obstacle(r, nx, ny)) {
+				r->x = nx;
+				r->y = ny;
+			}
+		} else if (strcmp(msg, SERVER_TURN_LEFT) == 0) {
+			r->dir = (r->dir + 3) % 4;
+		} else if (strcmp(msg, SERVER_TURN_RIGHT) == 0) {
+			r->dir = (r->dir + 1) % 4;
+		} else if (r->ahead > 0) {
+			return -1;
+		} else if (strcmp(msg, SERVER_PICK_UP) == 0) {
+			if (r->x != 0 || r->y != 0) {
+				return -1;
+			}
+			r->state = EXPECT_LOGOUT;
+			return robot_send(r, "Secret message");
+		} else {
+			return -1;
+		}
+		if (r->ahead > 0) {
+			r->ahead--;
+			return 0;
+		}
+		snprintf(buf, sizeof(buf), "OK %d %d", r->x, r->y);
+		return robot_send(r, buf);
+	case EXPECT_LOGOUT:
+		if (strcmp(msg, SERVER_LOGOUT) != 0) {
+			return -1;
+		}
+		w->commands += r->commands;
+		return 1;
+	}
+	return -1;
+}
+
+// Read what server sent and handle every complete message
+// return 0 to go on
+//        1 when session is over
+//        -1 on error
+int robot_read(struct worker* w, struct robot* r) {
+	char buf[1024];
+	int ret;
+	int i;
+	int n;
+
+	for (;;) {
+		n = read(r->fd, buf, sizeof(buf));
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		for (i = 0; i < n; i++) {
+			if (r->reply_len == REPLY_MAXLEN) {
+				return -1;
+			}
+			r->reply[r->reply_len++] = buf[i];
+			if (r->reply_len < 2 || r->reply[r->reply_len - 2] != '\a' ||
+			    r->reply[r->reply_len - 1] != '\b') {
+				continue;
+			}
+			r->reply[r->reply_len - 2] = '\0';
+			r->reply_len = 0;
+			hist_add(&w->latency, now_ns() - r->sent_ns);
+			ret = robot_step(w, r, r->reply);
+			if (ret != 0) {
+				return ret;
+			}
+		}
+	}
+}
+
+void* worker_loop(void* arg) {
+	struct worker* w = arg;
+	struct epoll_event events[MAX_EVENTS];
+	struct robot* robots;
+	int active = 0;
+	int epoll_fd;
+	int ret;
+	int n;
+	int i;
+
+	robots = calloc(w->nrobots, sizeof(*robots));
+	epoll_fd = epoll_create1(0);
+	if (robots == NULL || epoll_fd == -1) {
+		perror("worker");
+		exit(1);
+	}
+
+	for (i = 0; i < w->nrobots; i++) {
+		if (atomic_fetch_add(&sessions_started, 1) >= nsessions) {
+			break;
+		}
+		if (robot_start(w, &robots[i], epoll_fd) != 0) {
+			exit(1);
+		}
+		active++;
+	}
+
+	while (active > 0) {
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			exit(1);
+		}
+		for (i = 0; i < n; i++) {
+			struct robot* r = events[i].data.ptr;
+
+			if (r->state == EXPECT_CONNECT) {
+				ret = robot_connected(r, epoll_fd);
+			} else {
+				ret = robot_read(w, r);
+			}
+			if (ret == 0) {
+				continue;
+			}
+			if (ret == 1) {
+				w->sessions++;
+			} else {
+				w->failed++;
+			}
+			close(r->fd);
+			active--;
+			if (atomic_fetch_add(&sessions_started, 1) < nsessions) {
+				if (robot_start(w, r, epoll_fd) != 0) {
+					exit(1);
+				}
+				active++;
+			}
+		}
+	}
+	close(epoll_fd);
+	free(robots);
+	return NULL;
+}
+
+void usage(char* prog) {
+	fprintf(stderr,
+	        "usage: %s [-a address] [-p port] [-u path] [-c robots] [-n sessions]\n"
+	        "          [-t threads] [-o obstacles] [-g grid] [-k pipeline]\n"
+	        "  -a  server address, default 127.0.0.1\n"
+	        "  -p  server port, default %d\n"
+	        "  -u  connect to server unix socket path instead (server -u)\n"
+	        "  -c  robots connected at the same time, default 100\n"
+	        "  -n  sessions to run, default 10000\n"
+	        "  -t  threads, default 1\n"
+	        "  -o  max obstacles per grid, default 24\n"
+	        "  -g  robot starts within [-grid, grid], default 10\n"
+	        "  -k  robot logs in and answers this many commands at once,\n"
+	        "      before they arrive, default 0 (max %d)\n",
+	        prog, SERVER_PORT, MAX_PIPELINE);
+}
+
+int main(int argc, char** argv) {
+	struct histogram* latency;
+	struct worker* workers;
+	struct rlimit rl;
+	unsigned long long sessions = 0;
+	unsigned long long failed = 0;
+	unsigned long long commands = 0;
+	char* address = "127.0.0.1";
+	char* unix_path = NULL;
+	int port = SERVER_PORT;
+	long long start;
+	double elapsed;
+	int opt;
+	int i;
+	int j;
+
+	while ((opt = getopt(argc, argv, "a:p:u:c:n:t:o:g:k:")) != -1) {
+		switch (opt) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'u':
+			unix_path = optarg;
+			break;
+		case 'c':
+			concurrency = atoi(optarg);
+			break;
+		case 'n':
+			nsessions = atoll(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'o':
+			max_obstacles = atoi(optarg);
+			break;
+		case 'g':
+			grid = atoi(optarg);
+			break;
+		case 'k':
+			pipeline = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (concurrency < 1 || nthreads < 1 || nsessions < 1 || grid < 1 ||
+	    max_obstacles < 0 || max_obstacles > MAX_OBSTACLES ||
+	    max_obstacles >= (2 * grid + 1) * (2 * grid + 1) - 1 ||
+	    pipeline < 0 || pipeline > MAX_PIPELINE) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (nthreads > concurrency) {
+		nthreads = concurrency;
+	}
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	if (unix_path != NULL) {
+		struct sockaddr_un* un = (struct sockaddr_un*)&server_addr;
+
+		if (strlen(unix_path) >= sizeof(un->sun_path)) {
+			fprintf(stderr, "path is too long: %s\n", unix_path);
+			return 1;
+		}
+		un->sun_family = AF_UNIX;
+		strcpy(un->sun_path, unix_path);
+		server_addrlen = sizeof(*un);
+	} else {
+		struct sockaddr_in* in = (struct sockaddr_in*)&server_addr;
+
+		in->sin_family = AF_INET;
+		in->sin_port = htons(port);
+		if (inet_pton(AF_INET, address, &in->sin_addr) != 1) {
+			fprintf(stderr, "bad address: %s\n", address);
+			return 1;
+		}
+		server_addrlen = sizeof(*in);
+	}
+
+	// Every robot is a socket
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	workers = calloc(nthreads, sizeof(*workers));
+	latency = calloc(1, sizeof(*latency));
+	if (workers == NULL || latency == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	start = now_ns();
+	for (i = 0; i < nthreads; i++) {
+		workers[i].id = i;
+		workers[i].nrobots = concurrency / nthreads + (i < concurrency % nthreads);
+		workers[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1) ^ start;
+		if (pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]) != 0) {
+			fprintf(stderr, "pthread_create failed\n");
+			return 1;
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		sessions += workers[i].sessions;
+		failed += workers[i].failed;
+		commands += workers[i].commands;
+		for (j = 0; j < HIST_BUCKETS; j++) {
+			latency->counts[j] += workers[i].latency.counts[j];
+		}
+		latency->total += workers[i].latency.total;
+	}
+	elapsed = (now_ns() - start) / 1e9;
+
+	printf("sessions      %llu ok, %llu failed in %.3f s\n", sessions, failed, elapsed);
+	printf("sessions/sec  %.1f\n", sessions / elapsed);
+	printf("commands      %.2f per session\n", sessions ? (double)commands / sessions : 0.0);
+	printf("latency       p50 %.1f us, p99 %.1f us, p999 %.1f us (%llu round trips)\n",
+	       hist_percentile(latency, 50) / 1e3, hist_percentile(latency, 99) / 1e3,
+	       hist_percentile(latency, 99.9) / 1e3, latency->total);
+
+	free(latency);
+	free(workers);
+	return failed != 0;
+}
@@ -4,14 +4,254 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <stdbool.h>
 #include <errno.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <linux/io_uring.h>
 
-int start_connect_socket(unsigned short port)
+#define LOG_OFF 0
+#define LOG_ERROR 1
+#define LOG_WARN 2
+#define LOG_INFO 3
+#define LOG_DEBUG 4
+
+// Log events. Records carry raw data, text is composed by the log writer
+#define LOG_EV_CONNECT 1 // data: struct in_addr of robot, none on the unix socket
+#define LOG_EV_MESSAGE 2 // data: message received from robot
+#define LOG_EV_TEXT 3 // data: ready text
+
+#define LOG_DATA_LEN 104 // >= CLIENTMSG_MAXLEN
+#define LOG_RING_SIZE 4096 // records, power of 2
+#define LOG_FLUSH_MS 10 // writer sleeps that long when rings are empty
+
+struct log_record {
+	long long time; // ns of CLOCK_REALTIME
+	int fd;
+	unsigned char level;
+	unsigned char event;
+	unsigned short len;
+	char data[LOG_DATA_LEN];
+};
+
+// Single producer (worker) / single consumer (log writer) ring. Producer
+// never waits: record is dropped if the ring is full
+struct log_ring {
+	_Atomic unsigned int head; // next record to be written by producer
+	_Atomic unsigned int tail; // next record to be read by consumer
+	_Atomic unsigned long dropped;
+	int worker;
+	struct log_record records[LOG_RING_SIZE];
+};
+
+// Records more verbose than log_level are not composed at all
+int log_level = LOG_INFO;
+struct log_ring** log_rings;
+int log_nrings;
+pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread struct log_ring* log_ring;
+
+#define LOG_ENABLED(level) ((level) <= log_level)
+
+char* log_level_names[] = { "OFF", "ERROR", "WARN", "INFO", "DEBUG" };
+
+// Compose text of record \r to \out
+// return value:
+//     length of text
+int log_format(struct log_record* r, int worker, char* out) {
+	struct tm tm;
+	time_t sec;
+	char* p = out;
+	int i;
+
+	sec = r->time / 1000000000;
+	localtime_r(&sec, &tm);
+	p += strftime(p, 32, "%Y-%m-%d %H:%M:%S", &tm);
+	p += sprintf(p, ".%06lld %-5s w%d ", r->time % 1000000000 / 1000,
+		     log_level_names[r->level], worker);
+	switch (r->event) {
+	case LOG_EV_CONNECT:
+		p += sprintf(p, "connected %s to %d\n",
+			     r->len != 0 ? inet_ntoa(*(struct in_addr *)r->data) : "local", r->fd);
+		break;
+	case LOG_EV_MESSAGE:
+		p += sprintf(p, "%d bytes long msg from %d: \"", r->len, r->fd);
+		for (i = 0; i < r->len; i++) {
+			if (isprint((unsigned char)r->data[i])) {
+				*p++ = r->data[i];
+			} else {
+				p += sprintf(p, "\\%03o", (unsigned char)r->data[i]);
+			}
+		}
+		p += sprintf(p, "\"\n");
+		break;
+	case LOG_EV_TEXT:
+		memcpy(p, r->data, r->len);
+		p += r->len;
+		*p++ = '\n';
+		break;
+	}
+	return p - out;
+}
+
+// Write out all records of all rings. Output is batched: one write()
+// per LOG_BATCH bytes
+#define LOG_BATCH 65536
+
+void log_drain(void) {
+	static char out[LOG_BATCH];
+	struct log_ring* ring;
+	unsigned int head;
+	unsigned int tail;
+	unsigned long dropped;
+	int len = 0;
+	int i;
+
+	pthread_mutex_lock(&log_drain_lock);
+	for (i = 0; i < log_nrings; i++) {
+		ring = log_rings[i];
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		for (; tail != head; tail++) {
+			// worst case of a message escaped in octal
+			if (len + 64 + LOG_DATA_LEN * 4 > LOG_BATCH) {
+				write(STDOUT_FILENO, out, len);
+				len = 0;
+			}
+			len += log_format(&ring->records[tail & (LOG_RING_SIZE - 1)],
+					  ring->worker, out + len);
+		}
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+		dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+		if (dropped) {
+			len += sprintf(out + len, "w%d: %lu log records dropped\n",
+				       ring->worker, dropped);
+		}
+	}
+	if (len) {
+		write(STDOUT_FILENO, out, len);
+	}
+	pthread_mutex_unlock(&log_drain_lock);
+}
+
+void* log_writer(void* arg) {
+	struct timespec ts = { 0, LOG_FLUSH_MS * 1000000 };
+
+	(void)arg;
+	while (1) {
+		log_drain();
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+// Create log ring for each of \nworkers workers and start log writer thread
+void log_init(int nworkers) {
+	pthread_t thread;
+	int rc;
+	int i;
+
+	log_rings = calloc(nworkers, sizeof(log_rings[0]));
+	if (log_rings == NULL) {
+		perror("calloc failed");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < nworkers; i++) {
+		log_rings[i] = calloc(1, sizeof(*log_rings[i]));
+		if (log_rings[i] == NULL) {
+			perror("calloc failed");
+			exit(EXIT_FAILURE);
+		}
+		log_rings[i]->worker = i;
+	}
+	log_nrings = nworkers;
+	// Records still in rings are written out when a fatal error exits
+	atexit(log_drain);
+	rc = pthread_create(&thread, NULL, log_writer, NULL);
+	if (rc != 0) {
+		fprintf(stderr, "pthread_create failed: %s\n", strerror(rc));
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Push record to the log ring of the current worker. Check LOG_ENABLED
+// before calling, so that disabled levels cost nothing
+void log_event(int level, int event, int fd, const void* data, int len) {
+	struct log_ring* ring = log_ring;
+	struct log_record* r;
+	struct timespec ts;
+	unsigned int head;
+
+	if (ring == NULL) {
+		return;
+	}
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_SIZE) {
+		atomic_store_explicit(&ring->dropped,
+				      atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+				      memory_order_relaxed);
+		return;
+	}
+	r = &ring->records[head & (LOG_RING_SIZE - 1)];
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r->time = (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	r->fd = fd;
+	r->level = level;
+	r->event = event;
+	if (len > LOG_DATA_LEN) {
+		len = LOG_DATA_LEN;
+	}
+	r->len = len;
+	memcpy(r->data, data, len);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Log printf-style text. Text is composed by the caller, so use it for
+// rare events only
+void log_text(int level, int fd, const char* fmt, ...) {
+	char text[LOG_DATA_LEN];
+	va_list ap;
+	int len;
+
+	if (!LOG_ENABLED(level)) {
+		return;
+	}
+	va_start(ap, fmt);
+	len = vsnprintf(text, sizeof(text), fmt, ap);
+	va_end(ap);
+	if (len >= (int)sizeof(text)) {
+		len = sizeof(text) - 1;
+	}
+	if (log_ring == NULL) {
+		// not a worker thread
+		fprintf(stderr, "%s\n", text);
+		return;
+	}
+	log_event(level, LOG_EV_TEXT, fd, text, len);
+}
+
+// Create listening socket on \port with queue of \backlog connection
+// requests. If \reuseport is set, several sockets may be bound to the
+// same port and kernel balances incoming connections between them
+int start_connect_socket(unsigned short port, int reuseport, int backlog)
 {
 	int socket_fd;
 	int opt;
@@ -22,8 +262,9 @@ int start_connect_socket(unsigned short port)
 	 * create a socket - endpoint of the communication
 	 * AF_INET - IPv4 Internet protocol
 	 * SOCK_STREAM - connection based byte stream
+	 * SOCK_NONBLOCK - accept loop stops on EAGAIN when queue is drained
 	 */
-	socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+	socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (socket_fd == -1) {
 		perror("socket failed");
 		exit(EXIT_FAILURE);
@@ -38,6 +279,16 @@ int start_connect_socket(unsigned short port)
 		exit(EXIT_FAILURE);
 	}
 
+	/* every worker has own listening socket on the same port */
+	if (reuseport) {
+		rc = setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, (char *)&opt,
+				sizeof(opt));
+		if (rc == -1) {
+			perror("setsockopt failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	/* assign address to the socket to accept connections on any interface (INADDR_ANY) */
 	serveraddr.sin_family = AF_INET;
 	serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -49,9 +300,11 @@ int start_connect_socket(unsigned short port)
 		exit(EXIT_FAILURE);
 	}
 
-	/* mark the socket as listening for connection requests. 1 is
-	 * max length of queue of connection requests */
-	rc = listen(socket_fd, 1);
+	/* mark the socket as listening for connection requests. Queue has
+	 * to hold a burst of reconnecting robots, SYNs beyond it are dropped
+	 * and retried by robots a second later. Kernel caps backlog to
+	 * net.core.somaxconn */
+	rc = listen(socket_fd, backlog);
 	if (rc == -1) {
 		perror("listen failed");
 		exit(EXIT_FAILURE);
@@ -60,35 +313,132 @@ int start_connect_socket(unsigned short port)
 	return socket_fd;
 }
 
-int handle_connect(int socket_fd)
+// Listening unix socket at \path for robot gateways on the same host:
+// their messages skip the TCP/IP stack. All workers share it
+int start_unix_socket(char* path, int backlog)
+{
+	struct sockaddr_un addr;
+	int socket_fd;
+
+	socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (socket_fd == -1) {
+		perror("socket failed");
+		exit(EXIT_FAILURE);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "unix socket path is too long: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, path);
+	// socket left by a previous run
+	unlink(path);
+	if (bind(socket_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("bind unix socket failed");
+		exit(EXIT_FAILURE);
+	}
+	if (listen(socket_fd, backlog) == -1) {
+		perror("listen failed");
+		exit(EXIT_FAILURE);
+	}
+	return socket_fd;
+}
+
+// Accept a pending connection. The new socket is non-blocking: with
+// edge-triggered epoll every socket is read until EAGAIN, so a read must
+// never block the event loop
+// return value:
+//     fd of the connection, its source address in \addr (INADDR_ANY if
+//     it came over the unix socket)
+//     -1 if no connection is pending (errno EAGAIN) or accept failed
+int handle_connect(int socket_fd, struct in_addr* addr)
 {
-	struct sockaddr_in clientaddr;
+	struct sockaddr_storage clientaddr;
 	socklen_t size;
 	int rc;
 
-	size = sizeof(clientaddr);
-	rc = accept(socket_fd, (struct sockaddr *)&clientaddr, &size);
+	do {
+		size = sizeof(clientaddr);
+		rc = accept4(socket_fd, (struct sockaddr *)&clientaddr, &size,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC);
+		// robot gave up before it was accepted
+	} while (rc == -1 && (errno == EINTR || errno == ECONNABORTED));
 	if (rc == -1) {
-		perror("accept failed");
-		exit(EXIT_FAILURE);
+		return -1;
+	}
+	addr->s_addr = INADDR_ANY;
+	if (clientaddr.ss_family == AF_INET) {
+		*addr = ((struct sockaddr_in *)&clientaddr)->sin_addr;
+	}
+	if (LOG_ENABLED(LOG_INFO)) {
+		log_event(LOG_INFO, LOG_EV_CONNECT, rc, addr,
+			  addr->s_addr != INADDR_ANY ? sizeof(*addr) : 0);
 	}
-	printf("connected %s to %d\n", inet_ntoa(clientaddr.sin_addr), rc);
 	return rc;
 }
 
+// Turn away connection \fd over the admission limit. Reset instead of
+// orderly close: nothing is sent and no TIME_WAIT is left behind
+void reject_connect(int fd) {
+	struct linger lg = { 1, 0 };
+
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	close(fd);
+}
+
+
+// Bytes of \x equal to \c have their top bit set, no other bit is set.
+// Exact, unlike the usual haszero() trick, so masks can be combined
+#define BYTES_EQ(x, c) ({ \
+	unsigned long long _v = (x) ^ (0x0101010101010101ULL * (c)); \
+	~(((_v & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | _v | 0x7f7f7f7f7f7f7f7fULL); \
+})
 
+// Find "\a\b" in the first \length bytes of \msg
+// return value:
+//     offset of the terminator, i.e. length of the text before it
+//     -1 if there is no terminator
+// memchr() is vectorized by libc, so bytes are not visited one by one.
+// It looks for '\b', which ends the terminator, and the byte before is
+// checked, so '\a' in text costs nothing. Text rarely has '\b': if it
+// does, the rest is tested 8 positions at a time, a word where '\a' is
+// and the word one byte further where '\b' has to be. Either way every
+// byte is looked at once, a flood of '\a' or '\b' costs what text does
 int has_terminator(char* msg, int length) {
+	unsigned long long a;
+	unsigned long long b;
+	unsigned long long m;
+	char* p;
 	int i;
-	int len = -1;
 
-	for (i = 0; i < length - 1; i++) {
+	if (length < 2) {
+		return -1;
+	}
+	p = memchr(msg + 1, '\b', length - 1);
+	if (p == NULL) {
+		return -1;
+	}
+	if (p[-1] == '\a') {
+		return p - 1 - msg;
+	}
+	// p[0] is '\b', it does not start a terminator
+	for (i = p + 1 - msg; i + 9 <= length; i += 8) {
+		memcpy(&a, msg + i, 8);
+		memcpy(&b, msg + i + 1, 8);
+		m = BYTES_EQ(a, '\a') & BYTES_EQ(b, '\b');
+		if (m != 0) {
+			// little endian: the lowest byte is the first one
+			return i + __builtin_ctzll(m) / 8;
+		}
+	}
+	for (; i + 1 < length; i++) {
 		if (msg[i] == '\a' && msg[i + 1] == '\b') {
-			len = i;
-			break;
+			return i;
 		}
 	}
 
-	return len;
+	return -1;
 }
 
 
@@ -101,19 +451,24 @@ int has_terminator(char* msg, int length) {
 #define CLIENT_MESSAGE 7
 #define CLIENT_UNKNOWN 8
 
-// Check whether msg suits to format  "<text>\a\b" (text length + 2 <= max)
+// Robot may start recharging in any state, FULL POWER is the only
+// message it may send until it is done
+#define CLIENT_RECHARGING_MSG "RECHARGING\a\b"
+#define CLIENT_FULL_POWER_MSG "FULL POWER\a\b"
+#define RECHARGING_LEN 12 // of both
+
+// Check whether a message of \length bytes suits to format "<text>\a\b"
+// (text length + 2 <= max)
 // Can be used to check if message suits CLIENT_USERNAME (max = USERNAME_MAXLEN) or
 // CLIENT_MESSAGE (max = CLIENTMSG_MAXLEN)
+// Message is complete as split by handle_client_data, it ends with the
+// only "\a\b", so any text is valid and its bytes need no look
 // return true if yes
 // false otherwise
-_Bool decode_client_text(char* msg, int length, int max, int* textlen) {
+_Bool decode_client_text(int length, int max, int* textlen) {
 	int len;
 
-	len = has_terminator(msg, length);
-	if (len == -1) {
-		return false;
-	}
-
+	len = length - 2;
 	if ((len + 2 > max) || (len == 0)) {
 		return false;
 	}
@@ -122,23 +477,31 @@ _Bool decode_client_text(char* msg, int length, int max, int* textlen) {
 	return true;
 }
 
+// One comparison instead of two: chars below '0' wrap to large unsigned
+#define IS_DIGIT(c) ((unsigned)((c) - '0') <= 9)
+
 // Check whether msg suits to format "decimal number\a\b". Decimal num has to be less than max.
 // Can be used to check if message suits CLIENT_CONFIRMATION (max=65535) or CLIENT_KEY_ID (max=999).
+// Number is parsed in the single pass which checks the format, it is
+// rejected as soon as it exceeds max
 // return true if yes
 // 		  false otherwise 
 _Bool decode_client_keyid_confirm(char* msg, int max, int* key_id) {
-	char* p;
-	int num;
-	
-	num = strtol(msg, &p, 10);
-	if (num == 0 && errno == EINVAL) {
+	char* p = msg;
+	int num = 0;
+
+	if (!IS_DIGIT(*p)) {
 		// msg is not decimal number
 		return false;
 	}
-	if (num < 0 || num > max) {
-		return false;
+	while (IS_DIGIT(*p)) {
+		num = num * 10 + (*p - '0');
+		if (num > max) {
+			return false;
+		}
+		p++;
 	}
-
+	// msg ends with "\a\b", so p did not run past it
 	if (p[0] != '\a' || p[1] != '\b') {
 		return false;
 	}
@@ -147,21 +510,53 @@ _Bool decode_client_keyid_confirm(char* msg, int max, int* key_id) {
 	return true;
 }
 
+// Coordinates have at most that many digits
+#define COORD_MAXDIGITS 9
+
+// Parse decimal number with optional '-' at *pp, advance *pp past it
+// return true if there is a number
+// 		  false otherwise
+_Bool decode_coord(char** pp, int* val) {
+	char* p = *pp;
+	int neg = 0;
+	int num = 0;
+	int digits = 0;
 
+	if (*p == '-') {
+		neg = 1;
+		p++;
+	}
+	while (IS_DIGIT(*p)) {
+		if (++digits > COORD_MAXDIGITS) {
+			return false;
+		}
+		num = num * 10 + (*p - '0');
+		p++;
+	}
+	if (digits == 0) {
+		return false;
+	}
+	*val = neg ? -num : num;
+	*pp = p;
+	return true;
+}
 
 // Check whether msg suits to format "OK <x> <y>\a\b"
 // return true if yes
 // 		  false otherwise
 _Bool decode_client_ok(char* msg, int *x, int *y) {
-	char* p;
+	char* p = msg;
 
-	*x = strtol(msg + 3, &p, 10);
-	if (*x == 0 && errno == EINVAL) {
-		// No decimal number
+	// msg ends with "\a\b", comparisons stop before its end
+	if (p[0] != 'O' || p[1] != 'K' || p[2] != ' ') {
+		return false;
+	}
+	p += 3;
+	if (!decode_coord(&p, x) || *p != ' ') {
 		return false;
-	}	
-	*y = strtol(p, &p, 10);
-	if (*y == 0 && errno == EINVAL) {
+	}
+	p++;
+	if (!decode_coord(&p, y)) {
 		return false;
 	}
 	if (p[0] != '\a' || p[1] != '\b') {
@@ -190,6 +585,7 @@ _Bool decode_client_ok(char* msg, int *x, int *y) {
 #define EXPECT_CONFIRMATION 3
 #define EXPECT_CLIENT_OK 4
 #define EXPECT_CLIENT_MSG 5
+#define EXPECT_FULL_POWER 6 // parked while recharging
 
 #define USERNAME_MAXLEN 20
 #define KEYID_MAXLEN 5
@@ -200,7 +596,8 @@ _Bool decode_client_ok(char* msg, int *x, int *y) {
 // input arg:
 //     identifier of expected value
 // return value:
-//     maximal length of message identified by \msg_id
+//     maximal length of message identified by \msg_id. RECHARGING may
+//     come instead of any message, see recharging_maxlen()
 int clientmsg_maxlen(int msg_id) {
 	switch (msg_id) {
 	case EXPECT_USERNAME:
@@ -211,12 +608,13 @@ int clientmsg_maxlen(int msg_id) {
 		return CONFIRMATION_MAXLEN;
 	case EXPECT_CLIENT_OK:
 		return CLIENT_OK_MAXLEN;
+	case EXPECT_FULL_POWER:
+		return RECHARGING_LEN;
 	case EXPECT_CLIENT_MSG:
 		return CLIENTMSG_MAXLEN;
 	}
-
-	printf("Wrong msg_id\n");
-	exit(1);
+	// Session is broken, it is closed
+	return -1;
 }
 
 #define DIRECTION_RIGHT 1
@@ -227,706 +625,5099 @@ int clientmsg_maxlen(int msg_id) {
 #define X_UNKNOWN INT_MAX
 #define Y_UNKNOWN INT_MAX
 
-char* bypass_turn_left[8] = {
-	SERVER_TURN_LEFT,
-	SERVER_MOVE,
-	SERVER_TURN_RIGHT,
-	SERVER_MOVE,
-	SERVER_MOVE,
-	SERVER_TURN_RIGHT,
-	SERVER_MOVE,
-	SERVER_TURN_LEFT
-};
-char* bypass_turn_right[8] = {
-	SERVER_TURN_RIGHT,
-	SERVER_MOVE,
-	SERVER_TURN_LEFT,
-	SERVER_MOVE,
-	SERVER_MOVE,
-	SERVER_TURN_LEFT,
-	SERVER_MOVE,
-	SERVER_TURN_RIGHT
+// Moving and turning, indexed by DIRECTION_*
+int dir_dx[] = {
+	[DIRECTION_RIGHT] = 1,
+	[DIRECTION_LEFT] = -1,
+	[DIRECTION_UP] = 0,
+	[DIRECTION_DOWN] = 0,
+};
+int dir_dy[] = {
+	[DIRECTION_RIGHT] = 0,
+	[DIRECTION_LEFT] = 0,
+	[DIRECTION_UP] = 1,
+	[DIRECTION_DOWN] = -1,
+};
+unsigned char dir_left[] = {
+	[DIRECTION_RIGHT] = DIRECTION_UP,
+	[DIRECTION_UP] = DIRECTION_LEFT,
+	[DIRECTION_LEFT] = DIRECTION_DOWN,
+	[DIRECTION_DOWN] = DIRECTION_RIGHT,
+};
+unsigned char dir_right[] = {
+	[DIRECTION_RIGHT] = DIRECTION_DOWN,
+	[DIRECTION_DOWN] = DIRECTION_LEFT,
+	[DIRECTION_LEFT] = DIRECTION_UP,
+	[DIRECTION_UP] = DIRECTION_RIGHT,
 };
 
-struct {
-	int state;
+// Obstacles a robot bumped into are remembered for navigation. When more
+// are found, the oldest one is forgotten
+#define PLAN_MAX_OBSTACLES 16
+
+// Replies are queued and sent by a single sendmsg() once the input read
+// is processed. Queued entries point to SERVER_* literals or key_reply,
+// so nothing is copied
+#define OUTQ_LEN 8
+// A message is answered by at most SERVER_OK and SERVER_MOVE
+#define OUTQ_MSG_REPLIES 2
+// Input held back while the robot does not take replies
+#define CLIENT_BACKLOG_MAX 1024
+
+// Cold part of a session: buffers used only during login and while a
+// message is assembled from several reads, known obstacles and the
+// output queue
+struct client_buf {
 	char name[USERNAME_MAXLEN];
-	int namelen;
-	int keyid;
+	char client_msg[CLIENTMSG_MAXLEN];
+	int obstacles[PLAN_MAX_OBSTACLES][2]; // x, y
+	unsigned char obstacle_next; // to be replaced when all are in use
+	unsigned char parked_state; // EXPECT_* to go back to after recharging
+	char key_reply[16]; // "<hash>\a\b" reply to CLIENT_KEY_ID
+	struct iovec outq[OUTQ_LEN]; // replies not yet sent
+	char* backlog; // input not processed until outq has room, malloc()ed
+	unsigned short backlog_len;
+	// io_uring engine only
+	struct msghdr send_msg; // of the send in flight
+	unsigned char send_end; // outq entries covered by the send in flight
+	unsigned char sending;
+	unsigned char closing; // URING_CLOSE_*
+	unsigned char inflight; // operations the kernel still refers to session with
+	// metrics only
+	long long state_since; // us of CLOCK_MONOTONIC the current state began
+	unsigned short commands; // answered by robot
+	// limits
+	in_addr_t peer; // source address counted in peers, 0 if not counted
+	long long budget_deadline; // ms of CLOCK_MONOTONIC the state has to end by
+	unsigned short budget_bytes; // left for the state
+	// tracing only
+	unsigned int trace_id; // session number in the trace of the worker
+	long long trace_since; // us of CLOCK_MONOTONIC session began
+	unsigned int span_id; // thread of the session in spans of the worker
+};
+
+// Hot part of a session: fields touched on every message. Kept compact,
+// it fits a single cache line
+struct client_state {
+	int fd;
+	unsigned char state;
+	unsigned char direction;
+	unsigned char cur_size;
+	unsigned char namelen;
+	unsigned char did_turn; // right turns during orientation detection, 4..7 once all 4 headings are tried
+	unsigned char was_move; // flag is set to 1 during SERVER_MOVE
+	unsigned char blocked; // bit did_turn & 3 is set if MOVE failed during orientation detection
+	unsigned char nobstacles; // in buf->obstacles
+	unsigned char outq_len; // number of entries in buf->outq
+	unsigned char outq_sent; // entries of buf->outq already sent
+	unsigned short client_key; // of the key robot chose, kept over key reloads
 	int x;
 	int y;
-	int direction;
-	char client_msg[CLIENTMSG_MAXLEN];
-	int cur_size;
-	int did_turn; // did turn during orientation detection
-	int was_move; // flag is set to 1 during SERVER_MOVE
-	int in_bypass;
-	int bypass_cmd;
-	char** bypass_cmds;
-} client_states[FD_SETSIZE];
+	struct client_buf* buf;
+	long long deadline; // ms of CLOCK_MONOTONIC
+	struct timer_queue* timer; // queue the session is linked to or NULL
+	struct client_state* timer_prev;
+	struct client_state* timer_next; // next free session when not in use
+} __attribute__((aligned(64)));
 
-struct {
-	int server_key;
-	int client_key;
-} authentification_keys[5] = {
-	{23019, 32037},
-	{32037, 29295},
-	{18789, 13603},
-	{16443, 29533},
-	{18189, 21952}
+// Sessions are allocated in slabs of SESSION_SLAB_SIZE. The store grows
+// by a slab when all sessions are in use and never shrinks; freed
+// sessions are reused in LIFO order, while they are still in cache
+#define SESSION_SLAB_SIZE 256
+
+struct session_slab {
+	struct session_slab* next;
+	struct client_state states[SESSION_SLAB_SIZE];
+	struct client_buf bufs[SESSION_SLAB_SIZE];
 };
 
-int get_hash(char* name, int namelen) {
-	int sum = 0;
-	int i;
+struct session_store {
+	struct session_slab* slabs;
+	struct client_state* free;
+	int nsessions; // sessions in use
+	int capacity;
+};
 
-	for (i = 0; i < namelen; i++) {
-		sum += name[i];
-	}
-	sum *= 1000;
-	sum %= 65536;
+// Session store of the worker running in the current thread. Workers do
+// not share sessions, so the store needs no locking
+__thread struct session_store sessions;
 
-	return sum;
+/*
+ * Connections per source address (-i). Connections of all workers are
+ * counted in an open addressing table of 8 byte entries with linear
+ * probing, grown when half full. Entry of an address with no connections
+ * left is deleted by shifting the following ones back, so the table holds
+ * only addresses connected now and probes stay short. Kernel spreads
+ * connections of an address between SO_REUSEPORT listeners, so the table
+ * is shared for the limit to hold for the address as a whole. It is taken
+ * once per connect and close only, never per message
+ */
+#define PEER_TABLE_MIN 64 // entries, power of 2
+
+struct peer_entry {
+	in_addr_t addr; // 0 - free
+	unsigned int count;
+};
+
+struct peer_table {
+	struct peer_entry* entries;
+	unsigned int mask; // size - 1
+	unsigned int used;
+};
+
+struct peer_table peers; // under peers_lock
+pthread_mutex_t peers_lock = PTHREAD_MUTEX_INITIALIZER;
+int max_per_peer; // 0 - no limit
+
+unsigned int peer_hash(in_addr_t addr) {
+	unsigned int h = addr * 0x9e3779b1u;
+
+	return h ^ (h >> 16);
 }
 
-int next_step(int fd) {
-	ssize_t rc;
-	char* msg;
-	if (client_states[fd].x == 0 && client_states[fd].y > 0) {
-		// Have to go down
-		switch (client_states[fd].direction) {
-		case DIRECTION_DOWN:
-			msg = SERVER_MOVE;
-			break;
-		case DIRECTION_UP:	
-			msg = SERVER_TURN_LEFT;
-			client_states[fd].direction = DIRECTION_LEFT;
-			break;
-		case DIRECTION_LEFT:
-			msg = SERVER_TURN_LEFT;
-			client_states[fd].direction = DIRECTION_DOWN;
-			break;
-		case DIRECTION_RIGHT:
-			msg = SERVER_TURN_RIGHT;
-			client_states[fd].direction = DIRECTION_DOWN;
-			break;
-		}	
-	} else if (client_states[fd].x == 0 && client_states[fd].y < 0) {
-		// Have to go up
-		switch(client_states[fd].direction) {
-		case DIRECTION_UP:
-			msg = SERVER_MOVE;
-			break;
-		case DIRECTION_DOWN:
-			msg = SERVER_TURN_RIGHT;
-			client_states[fd].direction = DIRECTION_LEFT;
-			break;
-		case DIRECTION_LEFT:
-			msg = SERVER_TURN_RIGHT;
-			client_states[fd].direction = DIRECTION_UP;
-			break;
-		case DIRECTION_RIGHT:
-			msg = SERVER_TURN_LEFT;
-			client_states[fd].direction = DIRECTION_UP;
-			break;
-		}
-	} else if (client_states[fd].y == 0 && client_states[fd].x > 0) {
-		// Have to go left
-		switch (client_states[fd].direction) {
-		case DIRECTION_LEFT:
-			msg = SERVER_MOVE;
-			break;
-		case DIRECTION_UP:
-			msg = SERVER_TURN_LEFT;
-			client_states[fd].direction = DIRECTION_LEFT;
-			break;
-		case DIRECTION_RIGHT:
-			msg = SERVER_TURN_RIGHT;
-			client_states[fd].direction = DIRECTION_DOWN;
-			break;
-		case DIRECTION_DOWN:
-			msg = SERVER_TURN_RIGHT;
-			client_states[fd].direction = DIRECTION_LEFT;
-			break;
-		}
-	} else if (client_states[fd].y == 0 && client_states[fd].x < 0) {
-		// Have to go right
-		switch (client_states[fd].direction) {
-		case DIRECTION_RIGHT:
-			msg = SERVER_MOVE;
-			break;
-		case DIRECTION_UP:
-			msg = SERVER_TURN_RIGHT;
-			client_states[fd].direction = DIRECTION_RIGHT;
-			break;
-		case DIRECTION_LEFT:
-			msg = SERVER_TURN_LEFT;
-			client_states[fd].direction = DIRECTION_DOWN;
-			break;
-	    	case DIRECTION_DOWN:
-			msg = SERVER_TURN_LEFT;
-			client_states[fd].direction = DIRECTION_RIGHT;
-			break;
-		}
-	} else if (client_states[fd].x > 0 && client_states[fd].y > 0) {
-		// Have to go to left or down
-		switch (client_states[fd].direction) {
-		case DIRECTION_LEFT:
-		case DIRECTION_DOWN:
-			msg = SERVER_MOVE;
-			break;
-		case DIRECTION_RIGHT:
-			msg = SERVER_TURN_RIGHT;
-			client_states[fd].direction = DIRECTION_DOWN;
-			break;
-		case DIRECTION_UP:
-			msg = SERVER_TURN_LEFT;
-			client_states[fd].direction = DIRECTION_LEFT;
-			break;
-		}
-	} else if (client_states[fd].x > 0 && client_states[fd].y < 0) {
-		// Have to go left or up
-		switch (client_states[fd].direction) {
-		case DIRECTION_LEFT:
-		case DIRECTION_UP:
-			msg = SERVER_MOVE;
-			break;
-		case DIRECTION_RIGHT:
-			msg = SERVER_TURN_LEFT;
-			client_states[fd].direction = DIRECTION_UP;
-			break;
-		case DIRECTION_DOWN:
-			msg = SERVER_TURN_RIGHT;
-			client_states[fd].direction = DIRECTION_LEFT;
-			break;
-		}
-	} else if (client_states[fd].x < 0 && client_states[fd].y > 0) {
-		// Have to go right or down
-		switch (client_states[fd].direction) {
-		case DIRECTION_RIGHT:
-		case DIRECTION_DOWN:
-			msg = SERVER_MOVE;
-			break;
-		case DIRECTION_LEFT:
-			msg = SERVER_TURN_LEFT;
-			client_states[fd].direction = DIRECTION_DOWN;
-			break;
-		case DIRECTION_UP:
-			msg = SERVER_TURN_RIGHT;
-			client_states[fd].direction = DIRECTION_RIGHT;
-			break;
-		}
-	} else if (client_states[fd].x < 0 && client_states[fd].y < 0) {
-		// Have to go up or right
-		switch (client_states[fd].direction) {
-		case DIRECTION_UP:
-		case DIRECTION_RIGHT:
-			msg = SERVER_MOVE;
-			break;
-		case DIRECTION_LEFT:
-			msg = SERVER_TURN_RIGHT;
-			client_states[fd].direction = DIRECTION_UP;
-			break;
-		case DIRECTION_DOWN:
-			msg = SERVER_TURN_LEFT;
-			client_states[fd].direction = DIRECTION_RIGHT;
-			break;
-		}
-	} else {
-		printf("Unreachable code\n");
-		exit(1);
-	}
+// return value:
+//     index of entry of \addr in \t, or of the free entry it would take
+unsigned int peer_find(struct peer_table* t, in_addr_t addr) {
+	unsigned int i = peer_hash(addr) & t->mask;
 
-	rc = write(fd, msg, strlen(msg));
-	if (rc != strlen(msg)) {
-		return 1;
+	while (t->entries[i].addr != 0 && t->entries[i].addr != addr) {
+		i = (i + 1) & t->mask;
 	}
+	return i;
+}
 
-	client_states[fd].was_move = !strcmp(SERVER_MOVE, msg);
-	
+// return 0 on success
+//        -1 if out of memory
+int peer_grow(struct peer_table* t) {
+	struct peer_table n;
+	unsigned int i;
+
+	n.mask = t->entries != NULL ? t->mask * 2 + 1 : PEER_TABLE_MIN - 1;
+	n.used = t->used;
+	n.entries = calloc(n.mask + 1, sizeof(n.entries[0]));
+	if (n.entries == NULL) {
+		return -1;
+	}
+	for (i = 0; t->entries != NULL && i <= t->mask; i++) {
+		if (t->entries[i].addr != 0) {
+			n.entries[peer_find(&n, t->entries[i].addr)] = t->entries[i];
+		}
+	}
+	free(t->entries);
+	*t = n;
 	return 0;
 }
 
-#define MSG_COMPLETE 1
-#define MSG_INCOMPLETE 2
-#define MSG_WRONG 3
+// Count connection of session \cs from \addr
+// return 0 if address is within the limit
+//        -1 if it has too many connections, connection is not counted
+int peer_acquire(struct client_state* cs, in_addr_t addr) {
+	struct peer_entry* e;
+	int rc = -1;
 
-int is_complete(char* buf, ssize_t size, int fd, int* tail_size) {
-	int i;
-	int old_len;
+	if (addr == 0) {
+		return 0;
+	}
+	pthread_mutex_lock(&peers_lock);
+	if ((peers.used + 1) * 2 > peers.mask + 1 && peer_grow(&peers) != 0) {
+		goto out;
+	}
+	e = &peers.entries[peer_find(&peers, addr)];
+	if (e->count >= (unsigned int)max_per_peer) {
+		goto out;
+	}
+	if (e->addr == 0) {
+		e->addr = addr;
+		peers.used++;
+	}
+	e->count++;
+	cs->buf->peer = addr;
+	rc = 0;
+out:
+	pthread_mutex_unlock(&peers_lock);
+	return rc;
+}
 
-	old_len = client_states[fd].cur_size;
-	for (i = 0; i < size; i++) {
-		if (old_len + i == CLIENTMSG_MAXLEN) {
-			return MSG_WRONG;
-		}
-		client_states[fd].client_msg[old_len + i] = buf[i];
-		client_states[fd].cur_size++;
-		if (buf[i] == '\b') {
-			// Check previous char
-			if (i + old_len != 0 && client_states[fd].client_msg[old_len + i - 1] == '\a') {
-				// \a\b at the end
-				*tail_size = size - (i + 1);
-				
-				return MSG_COMPLETE;
-			}
+// Connection of session \cs is gone
+void peer_release(struct client_state* cs) {
+	struct peer_entry* e;
+	unsigned int home;
+	unsigned int i;
+	unsigned int j;
+
+	pthread_mutex_lock(&peers_lock);
+	e = peers.entries;
+	i = peer_find(&peers, cs->buf->peer);
+	cs->buf->peer = 0;
+	if (--e[i].count != 0) {
+		pthread_mutex_unlock(&peers_lock);
+		return;
+	}
+	// Move back entries which would not be found past the hole
+	for (j = (i + 1) & peers.mask; e[j].addr != 0; j = (j + 1) & peers.mask) {
+		home = peer_hash(e[j].addr) & peers.mask;
+		if (((j - home) & peers.mask) >= ((j - i) & peers.mask)) {
+			e[i] = e[j];
+			i = j;
 		}
 	}
-	*tail_size = 0;
-	return MSG_INCOMPLETE;
+	e[i].addr = 0;
+	e[i].count = 0;
+	peers.used--;
+	pthread_mutex_unlock(&peers_lock);
 }
 
-void print_client_msg(int fd, char* msg, int msg_len) {
+// return value:
+//     new session with all hot fields zeroed, NULL if out of memory
+struct client_state* session_alloc(void) {
+	struct client_state* cs;
+	struct client_buf* buf;
 	int i;
 
-	printf("%d bytes long msg from %d: \"", msg_len, fd);
-	for (i = 0; i < msg_len; i++) {
-		if (isprint(msg[i])) {
-			printf("%c", msg[i]);
-		} else {
-			printf("\\%03o", msg[i]);
+	if (sessions.free == NULL) {
+		struct session_slab* slab;
+
+		slab = aligned_alloc(64, sizeof(*slab));
+		if (slab == NULL) {
+			return NULL;
 		}
+		for (i = SESSION_SLAB_SIZE - 1; i >= 0; i--) {
+			slab->states[i].buf = &slab->bufs[i];
+			slab->bufs[i].backlog = NULL;
+			slab->states[i].state = 0; // not in use
+			slab->states[i].timer_next = sessions.free;
+			sessions.free = &slab->states[i];
+		}
+		slab->next = sessions.slabs;
+		sessions.slabs = slab;
+		sessions.capacity += SESSION_SLAB_SIZE;
 	}
-	printf("\"\n");
-}
+	cs = sessions.free;
+	sessions.free = cs->timer_next;
+	sessions.nsessions++;
 
-int start_bypass_turn_right(int fd) {
-	client_states[fd].bypass_cmds = bypass_turn_right;
-	client_states[fd].bypass_cmd = 0;
-	client_states[fd].in_bypass = 1;
+	// Cold buffer is not cleared: it is valid only up to cur_size/namelen
+	buf = cs->buf;
+	memset(cs, 0, sizeof(*cs));
+	cs->buf = buf;
+	buf->closing = 0;
+	buf->peer = 0;
+	buf->backlog_len = 0;
+	return cs;
 }
 
-int start_bypass_turn_left(int fd) {
-	client_states[fd].bypass_cmds = bypass_turn_left;
-	client_states[fd].bypass_cmd = 0;
-	client_states[fd].in_bypass = 1;
+void session_free(struct client_state* cs) {
+	if (cs->buf->peer != 0) {
+		peer_release(cs);
+	}
+	free(cs->buf->backlog);
+	cs->buf->backlog = NULL;
+	cs->state = 0;
+	cs->timer_next = sessions.free;
+	sessions.free = cs;
+	sessions.nsessions--;
 }
 
-int handle_client_msg(int fd, fd_set *fds)
-{
-	char buf[1024];
-	char* pbuf;
-	int bytes;
-	char* cmd;
-	int cmd_len;
-	ssize_t rc;
-	int tail_size;
-	char* tail;
+// Give back the slabs of the worker once it has no sessions left
+void session_store_destroy(void) {
+	struct session_slab* slab;
 
-	pbuf = buf;
-	bytes = read(fd, buf, sizeof(buf));
-	if (bytes == -1) {
-		perror("read failed");
-		exit(EXIT_FAILURE);
+	while (sessions.slabs != NULL) {
+		slab = sessions.slabs;
+		sessions.slabs = slab->next;
+		free(slab);
 	}
-	while (1) {
-		// Check wether message is complete
-		switch (is_complete(pbuf, bytes, fd, &tail_size)) {
-		case MSG_WRONG:
-			close(fd);
-			FD_CLR(fd, fds);
-			return 0;
-		case MSG_INCOMPLETE:
-			if (client_states[fd].cur_size >= clientmsg_maxlen(client_states[fd].state)) {
-				rc = write(fd, SERVER_SYNTAX_ERROR, strlen(SERVER_SYNTAX_ERROR));
-				if (rc != strlen(SERVER_SYNTAX_ERROR)) {
-					close(fd);
-					FD_CLR(fd, fds);
-					return 0;
-				}
-				return 0;
-			}
-			// Wait for command completion
-			return 0;
-		case MSG_COMPLETE:
-			tail = pbuf + bytes - tail_size;
-			pbuf = tail;
-			bytes = tail_size;
-			break;
-		}
-		cmd = client_states[fd].client_msg;
-		cmd_len = client_states[fd].cur_size;
-
-		print_client_msg(fd, cmd, cmd_len);
+	sessions.free = NULL;
+	sessions.capacity = 0;
+}
 
-		client_states[fd].cur_size = 0;
-		if (client_states[fd].state == EXPECT_USERNAME) {
-			int textlen;
+// Robot has to send complete message within CLIENT_TIMEOUT_MS
+#define CLIENT_TIMEOUT_MS 1000
+// and FULL POWER within RECHARGING_TIMEOUT_MS after RECHARGING
+#define RECHARGING_TIMEOUT_MS 5000
 
-			// Check that client send CLIENT_USERNAME message
-			if (!decode_client_text(cmd, cmd_len, USERNAME_MAXLEN, &textlen)){
-				// Not CLIENT_USERNAME
-				rc = write(fd, SERVER_SYNTAX_ERROR, strlen(SERVER_SYNTAX_ERROR));
-				if (rc != strlen(SERVER_SYNTAX_ERROR)) {
-					close(fd);
-					FD_CLR(fd, fds);
-					return 0;
-				}
-				close(fd);
-				FD_CLR(fd, fds);
-				return 0;
-			}
-			client_states[fd].namelen = textlen;
-			memcpy(client_states[fd].name, cmd, textlen);
-			rc = write(fd, SERVER_KEY_REQUEST, strlen(SERVER_KEY_REQUEST));
-			if (rc != strlen(SERVER_KEY_REQUEST)) {
-				close(fd);
-				FD_CLR(fd, fds);
-				return 0;
-			}
-			client_states[fd].state = EXPECT_KEY_ID;
-			continue;
-		}
+// Queue of session deadlines. All deadlines of one queue have the same
+// duration, so a deadline being armed is never earlier than the queued
+// ones and goes to the tail. Arming, cancelling and finding the nearest
+// deadline are O(1)
+struct timer_queue {
+	struct client_state* head;
+	struct client_state* tail;
+	int timeout; // ms
+};
 
-		if (client_states[fd].state == EXPECT_KEY_ID) {
-			int hash;
-			int key_id;
-			char tmp[128];
+__thread struct timer_queue session_timers = { NULL, NULL, CLIENT_TIMEOUT_MS };
+// Parked sessions have a queue of their own, the event loop looks only
+// at its head however many robots are recharging
+__thread struct timer_queue recharging_timers = { NULL, NULL, RECHARGING_TIMEOUT_MS };
 
-			if (!decode_client_keyid_confirm(cmd, 999, &key_id)) {
-				// Not CLIENT_KEY_ID
-				rc = write(fd, SERVER_SYNTAX_ERROR, strlen(SERVER_SYNTAX_ERROR));
-				if (rc != strlen(SERVER_SYNTAX_ERROR)) {
-					close(fd);
-					FD_CLR(fd, fds);
-					return 0;
-				}
-				close(fd);
-				FD_CLR(fd, fds);
-				return 0;
-			}
-			if (0 > key_id || key_id > 4) {
-				// Key_id out of range
-				rc = write(fd, SERVER_KEY_OUT_OF_RANGE_ERROR, strlen(SERVER_KEY_OUT_OF_RANGE_ERROR));
-				if (rc != strlen(SERVER_KEY_OUT_OF_RANGE_ERROR)) {
-					close(fd);
-					FD_CLR(fd, fds);
-					return 0;
-				}
-				close(fd);
-				FD_CLR(fd, fds);
-				return 0;
-			}
-		
-			// Compose reply to the client
-			hash = get_hash(client_states[fd].name, client_states[fd].namelen);
-			hash += authentification_keys[key_id].server_key;
-			hash %= 65536;
-			sprintf(tmp, "%d\a\b", hash);
-			rc = write(fd, tmp, strlen(tmp));
-			if (rc != strlen(tmp)) {
-				close(fd);
-				FD_CLR(fd, fds);
-				return 0;
-			}
-			client_states[fd].state = EXPECT_CONFIRMATION;
-			client_states[fd].keyid = key_id;
+long long now_ms(void) {
+	struct timespec ts;
 
-			continue;
-		}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-		if (client_states[fd].state == EXPECT_CONFIRMATION) {
-			int code;
-			char* tmp;
+void timer_cancel(struct client_state* cs) {
+	struct timer_queue* q = cs->timer;
 
-			if (!decode_client_keyid_confirm(cmd, 65535, &code)) {
-				// Not CLIENT_CONFIRMATION
-				rc = write(fd, SERVER_SYNTAX_ERROR, strlen(SERVER_SYNTAX_ERROR));
-				if (rc != strlen(SERVER_SYNTAX_ERROR)) {
-					close(fd);
-					FD_CLR(fd, fds);
-					return 0;
+	if (q == NULL) {
+		return;
+	}
+	if (cs->timer_prev) {
+		cs->timer_prev->timer_next = cs->timer_next;
+	} else {
+		q->head = cs->timer_next;
+	}
+	if (cs->timer_next) {
+		cs->timer_next->timer_prev = cs->timer_prev;
+	} else {
+		q->tail = cs->timer_prev;
+	}
+	cs->timer = NULL;
+}
+
+// (Re)start deadline of session \cs: it expires q->timeout ms from now
+void timer_arm(struct timer_queue* q, struct client_state* cs) {
+	timer_cancel(cs);
+	cs->deadline = now_ms() + q->timeout;
+	cs->timer = q;
+	cs->timer_next = NULL;
+	cs->timer_prev = q->tail;
+	if (q->tail) {
+		q->tail->timer_next = cs;
+	} else {
+		q->head = cs;
+	}
+	q->tail = cs;
+}
+
+// return value:
+//     ms until the nearest deadline of \q, -1 if there is none
+int timer_next_timeout(struct timer_queue* q, long long now) {
+	if (q->head == NULL) {
+		return -1;
+	}
+	if (q->head->deadline <= now) {
+		return 0;
+	}
+	return q->head->deadline - now;
+}
+
+// return value:
+//     ms until the nearest deadline of any session of the worker, -1 if
+//     there is none
+int timers_next_timeout(long long now) {
+	int active = timer_next_timeout(&session_timers, now);
+	int parked = timer_next_timeout(&recharging_timers, now);
+
+	if (active == -1 || (parked != -1 && parked < active)) {
+		return parked;
+	}
+	return active;
+}
+
+// Minimum progress. Deadline of a message is restarted by every message,
+// so a robot could hold its session forever without getting anywhere:
+// recharging again and again, or reporting positions which never reach
+// the target. Every state has to be finished within a budget of time and
+// bytes received, recharging included
+#define RECHARGE_BYTES (2 * RECHARGING_LEN)
+#define NAV_MAX_COMMANDS 1000 // of the longest OK
+
+struct state_budget {
+	int ms;
+	int bytes;
+};
+
+struct state_budget state_budgets[] = {
+	[EXPECT_USERNAME] = { 12000, USERNAME_MAXLEN + 2 * RECHARGE_BYTES },
+	[EXPECT_KEY_ID] = { 12000, KEYID_MAXLEN + 2 * RECHARGE_BYTES },
+	[EXPECT_CONFIRMATION] = { 12000, CONFIRMATION_MAXLEN + 2 * RECHARGE_BYTES },
+	[EXPECT_CLIENT_OK] = { 60000, NAV_MAX_COMMANDS * CLIENT_OK_MAXLEN + 4 * RECHARGE_BYTES },
+	[EXPECT_CLIENT_MSG] = { 12000, CLIENTMSG_MAXLEN + 2 * RECHARGE_BYTES },
+};
+
+// Session \cs entered state \state
+void budget_start(struct client_state* cs, int state) {
+	cs->buf->budget_deadline = now_ms() + state_budgets[state].ms;
+	cs->buf->budget_bytes = state_budgets[state].bytes;
+}
+
+/*
+ * Metrics. Each worker updates its own struct metrics and is the only
+ * writer of it, so updates are plain relaxed load and store, with no
+ * locked instructions. The metrics thread sums all workers when it is
+ * scraped through the admin socket (-m)
+ */
+
+// Why a session ended
+#define END_LOGOUT 0
+#define END_SYNTAX_ERROR 1
+#define END_LOGIN_FAILED 2
+#define END_KEY_OUT_OF_RANGE 3
+#define END_TIMEOUT 4
+#define END_CLOSED 5 // robot closed connection or it broke
+#define END_LOGIC_ERROR 6 // anything but FULL POWER while recharging
+#define END_NO_PROGRESS 7 // state budget is spent
+#define END_INTERNAL_ERROR 8
+#define END_COUNT 9
+
+char* end_names[] = {
+	[END_LOGOUT] = "logout",
+	[END_SYNTAX_ERROR] = "syntax_error",
+	[END_LOGIN_FAILED] = "login_failed",
+	[END_KEY_OUT_OF_RANGE] = "key_out_of_range",
+	[END_TIMEOUT] = "timeout",
+	[END_CLOSED] = "closed",
+	[END_LOGIC_ERROR] = "logic_error",
+	[END_NO_PROGRESS] = "no_progress",
+	[END_INTERNAL_ERROR] = "internal_error",
+};
+
+// Indexed by EXPECT_*
+#define STATE_COUNT (EXPECT_FULL_POWER + 1)
+
+char* state_names[] = {
+	[EXPECT_USERNAME] = "username",
+	[EXPECT_KEY_ID] = "key_id",
+	[EXPECT_CONFIRMATION] = "confirmation",
+	[EXPECT_CLIENT_OK] = "client_ok",
+	[EXPECT_CLIENT_MSG] = "client_msg",
+	[EXPECT_FULL_POWER] = "recharging",
+};
+
+// Log-linear histogram: values below 2 * HIST_SUB are counted exactly,
+// above that every power of 2 is split into HIST_SUB buckets, so a value
+// is known within 1 / HIST_SUB. The last bucket takes everything above
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS) * HIST_SUB)
+
+struct histogram {
+	_Atomic unsigned long long counts[HIST_BUCKETS];
+	_Atomic unsigned long long sum;
+};
+
+struct metrics {
+	_Atomic unsigned long long accepts;
+	_Atomic unsigned long long rejects; // over admission limit
+	_Atomic unsigned long long peer_rejects; // over limit of source address
+	_Atomic unsigned long long accept_errors; // but running out of descriptors
+	_Atomic unsigned long long fd_exhausted; // connections shed for lack of descriptors
+	_Atomic unsigned long long read_errors; // reset connections mostly
+	_Atomic unsigned long long active; // sessions
+	_Atomic unsigned long long ends[END_COUNT];
+	_Atomic unsigned long long bytes_in;
+	_Atomic unsigned long long bytes_out;
+	struct histogram state_time[STATE_COUNT]; // us spent in EXPECT_*
+	struct histogram commands; // per session which reached the target
+} __attribute__((aligned(64)));
+
+#define METRIC_ADD(counter, n) \
+	atomic_store_explicit(&(counter), \
+			      atomic_load_explicit(&(counter), memory_order_relaxed) + (n), \
+			      memory_order_relaxed)
+#define METRIC_SET(counter, v) atomic_store_explicit(&(counter), (v), memory_order_relaxed)
+
+struct metrics** worker_metrics;
+int metrics_nworkers;
+// Threads which are not workers count to metrics nobody reads
+struct metrics metrics_unused;
+__thread struct metrics* metrics = &metrics_unused;
+
+int hist_bucket(unsigned long long v) {
+	int shift;
+
+	if (v < 2 * HIST_SUB) {
+		return v;
+	}
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	if (shift + 1 >= HIST_BUCKETS / HIST_SUB) {
+		// 2^63 and above, e.g. a negative difference of clock readings
+		return HIST_BUCKETS - 1;
+	}
+	return (shift + 1) * HIST_SUB + (v >> shift) - HIST_SUB;
+}
+
+// return value:
+//     highest value counted in bucket \i
+unsigned long long hist_bucket_max(int i) {
+	int shift;
+
+	if (i < 2 * HIST_SUB) {
+		return i;
+	}
+	shift = i / HIST_SUB - 1;
+	return ((unsigned long long)(i % HIST_SUB + HIST_SUB + 1) << shift) - 1;
+}
+
+void hist_add(struct histogram* h, unsigned long long v) {
+	METRIC_ADD(h->counts[hist_bucket(v)], 1);
+	METRIC_ADD(h->sum, v);
+}
+
+long long now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+long long now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Session \cs was accepted, it is in its initial state
+void metrics_session_start(struct client_state* cs) {
+	METRIC_ADD(metrics->accepts, 1);
+	METRIC_SET(metrics->active, sessions.nsessions);
+	cs->buf->state_since = now_us();
+	cs->buf->commands = 0;
+}
+
+// Session \cs leaves state \state
+void metrics_state_end(struct client_state* cs, int state) {
+	long long now = now_us();
+
+	if (state >= STATE_COUNT) {
+		// Corrupt state, session ends for END_INTERNAL_ERROR
+		return;
+	}
+	hist_add(&metrics->state_time[state], now - cs->buf->state_since);
+	cs->buf->state_since = now;
+}
+
+// Session \cs is closed for \reason END_*
+void metrics_session_end(struct client_state* cs, int reason) {
+	metrics_state_end(cs, cs->state);
+	METRIC_ADD(metrics->ends[reason], 1);
+	// session is freed after this
+	METRIC_SET(metrics->active, sessions.nsessions - 1);
+	if (reason == END_LOGOUT) {
+		hist_add(&metrics->commands, cs->buf->commands);
+	}
+}
+
+// Histogram \name{\label} summed over workers. Values are divided by
+// \scale (e.g. us to seconds). Only buckets which counted something are
+// written, buckets are cumulative anyway
+void metrics_write_hist(FILE* out, char* name, char* label, int offset, double scale) {
+	unsigned long long count = 0;
+	unsigned long long sum = 0;
+	unsigned long long n;
+	struct histogram* h;
+	int i;
+	int j;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		n = 0;
+		for (j = 0; j < metrics_nworkers; j++) {
+			h = (struct histogram*)((char*)worker_metrics[j] + offset);
+			n += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+		}
+		if (n == 0) {
+			continue;
+		}
+		count += n;
+		fprintf(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, label, *label ? "," : "",
+			hist_bucket_max(i) / scale, count);
+	}
+	for (j = 0; j < metrics_nworkers; j++) {
+		h = (struct histogram*)((char*)worker_metrics[j] + offset);
+		sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+	}
+	fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, label, *label ? "," : "", count);
+	fprintf(out, "%s_sum%s%s%s %g\n", name, *label ? "{" : "", label, *label ? "}" : "",
+		sum / scale);
+	fprintf(out, "%s_count%s%s%s %llu\n", name, *label ? "{" : "", label, *label ? "}" : "",
+		count);
+}
+
+// Sum of counter at \offset in struct metrics over workers
+unsigned long long metrics_sum(int offset) {
+	unsigned long long sum = 0;
+	int i;
+
+	for (i = 0; i < metrics_nworkers; i++) {
+		sum += atomic_load_explicit((_Atomic unsigned long long*)((char*)worker_metrics[i] + offset),
+					    memory_order_relaxed);
+	}
+	return sum;
+}
+
+// Write all metrics in Prometheus text exposition format
+void metrics_write(FILE* out) {
+	char label[64];
+	int i;
+
+	fprintf(out, "# TYPE robot_accepts_total counter\n");
+	fprintf(out, "robot_accepts_total %llu\n", metrics_sum(offsetof(struct metrics, accepts)));
+	fprintf(out, "# TYPE robot_rejects_total counter\n");
+	fprintf(out, "robot_rejects_total %llu\n", metrics_sum(offsetof(struct metrics, rejects)));
+	fprintf(out, "# TYPE robot_peer_rejects_total counter\n");
+	fprintf(out, "robot_peer_rejects_total %llu\n", metrics_sum(offsetof(struct metrics, peer_rejects)));
+	fprintf(out, "# TYPE robot_accept_errors_total counter\n");
+	fprintf(out, "robot_accept_errors_total %llu\n", metrics_sum(offsetof(struct metrics, accept_errors)));
+	fprintf(out, "# TYPE robot_fd_exhausted_total counter\n");
+	fprintf(out, "robot_fd_exhausted_total %llu\n", metrics_sum(offsetof(struct metrics, fd_exhausted)));
+	fprintf(out, "# TYPE robot_read_errors_total counter\n");
+	fprintf(out, "robot_read_errors_total %llu\n", metrics_sum(offsetof(struct metrics, read_errors)));
+	fprintf(out, "# TYPE robot_sessions_active gauge\n");
+	fprintf(out, "robot_sessions_active %llu\n", metrics_sum(offsetof(struct metrics, active)));
+	fprintf(out, "# TYPE robot_sessions_finished_total counter\n");
+	fprintf(out, "robot_sessions_finished_total %llu\n",
+		metrics_sum(offsetof(struct metrics, ends[END_LOGOUT])));
+	fprintf(out, "# TYPE robot_sessions_failed_total counter\n");
+	for (i = END_LOGOUT + 1; i < END_COUNT; i++) {
+		fprintf(out, "robot_sessions_failed_total{reason=\"%s\"} %llu\n", end_names[i],
+			metrics_sum(offsetof(struct metrics, ends) + i * sizeof(unsigned long long)));
+	}
+	fprintf(out, "# TYPE robot_received_bytes_total counter\n");
+	fprintf(out, "robot_received_bytes_total %llu\n", metrics_sum(offsetof(struct metrics, bytes_in)));
+	fprintf(out, "# TYPE robot_sent_bytes_total counter\n");
+	fprintf(out, "robot_sent_bytes_total %llu\n", metrics_sum(offsetof(struct metrics, bytes_out)));
+	fprintf(out, "# TYPE robot_state_seconds histogram\n");
+	for (i = EXPECT_USERNAME; i < STATE_COUNT; i++) {
+		snprintf(label, sizeof(label), "state=\"%s\"", state_names[i]);
+		metrics_write_hist(out, "robot_state_seconds", label,
+				   offsetof(struct metrics, state_time) + i * sizeof(struct histogram), 1e6);
+	}
+	fprintf(out, "# TYPE robot_commands_per_session histogram\n");
+	metrics_write_hist(out, "robot_commands_per_session", "",
+			   offsetof(struct metrics, commands), 1);
+}
+
+// Admin socket: every connection gets a scrape of all metrics and is
+// closed
+void* metrics_server(void* arg) {
+	int socket_fd = (long)arg;
+	FILE* out;
+	int fd;
+
+	while (1) {
+		fd = accept(socket_fd, NULL, NULL);
+		if (fd == -1) {
+			continue;
+		}
+		out = fdopen(fd, "w");
+		if (out == NULL) {
+			close(fd);
+			continue;
+		}
+		metrics_write(out);
+		fclose(out);
+	}
+	return NULL;
+}
+
+// Create metrics of \nworkers workers and serve them on unix socket
+// \path, if it is not NULL
+void metrics_init(int nworkers, char* path) {
+	struct sockaddr_un addr;
+	pthread_t thread;
+	int socket_fd;
+	int rc;
+	int i;
+
+	worker_metrics = calloc(nworkers, sizeof(worker_metrics[0]));
+	if (worker_metrics == NULL) {
+		perror("calloc failed");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < nworkers; i++) {
+		worker_metrics[i] = aligned_alloc(64, sizeof(struct metrics));
+		if (worker_metrics[i] == NULL) {
+			perror("aligned_alloc failed");
+			exit(EXIT_FAILURE);
+		}
+		memset(worker_metrics[i], 0, sizeof(struct metrics));
+	}
+	metrics_nworkers = nworkers;
+	if (path == NULL) {
+		return;
+	}
+
+	socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (socket_fd == -1) {
+		perror("socket failed");
+		exit(EXIT_FAILURE);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "metrics socket path is too long: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, path);
+	// socket left by a previous run
+	unlink(path);
+	if (bind(socket_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("bind metrics socket failed");
+		exit(EXIT_FAILURE);
+	}
+	if (listen(socket_fd, 16) == -1) {
+		perror("listen failed");
+		exit(EXIT_FAILURE);
+	}
+	rc = pthread_create(&thread, NULL, metrics_server, (void*)(long)socket_fd);
+	if (rc != 0) {
+		fprintf(stderr, "pthread_create failed: %s\n", strerror(rc));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Session traces (-t). Every worker appends records of its sessions to
+ * its own file <path>.<worker>: session start, every chunk of input as it
+ * was read (so TCP fragmentation is kept), every reply queued and the end
+ * of the session. Records are buffered and written once per event loop
+ * iteration. Replay (-R) feeds the input of a trace through
+ * handle_client_data() without sockets and checks that replies and the
+ * end of every session are the same byte for byte
+ */
+#define TRACE_MAGIC "RBTTRACE"
+#define TRACE_VERSION 1
+#define TRACE_BUF_SIZE 65536
+
+#define TRACE_OPEN 1 // no data
+#define TRACE_IN 2 // data: bytes read from robot
+#define TRACE_OUT 3 // data: reply queued
+#define TRACE_CLOSE 4 // data: END_* byte
+
+struct trace_record {
+	unsigned int session; // trace_id
+	unsigned int time; // us since session start, saturated
+	unsigned short len; // of data following the record
+	unsigned char type; // TRACE_*
+	unsigned char reserved;
+};
+
+struct trace {
+	int fd; // -1 if records are only kept in buf (replay)
+	unsigned int next_id;
+	size_t len;
+	size_t size;
+	char* buf;
+};
+
+// Trace of the current worker, NULL if sessions are not traced
+__thread struct trace* trace;
+char* trace_path;
+
+// return 0 on success
+//        -1 if trace file can not be written
+int trace_flush(struct trace* t) {
+	size_t off = 0;
+	ssize_t rc;
+
+	while (off < t->len) {
+		rc = write(t->fd, t->buf + off, t->len - off);
+		if (rc == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		off += rc;
+	}
+	t->len = 0;
+	return 0;
+}
+
+// Write out records buffered by the current worker. Tracing stops if the
+// file can not be written
+void trace_sync(void) {
+	if (trace == NULL || trace->fd == -1 || trace->len == 0) {
+		return;
+	}
+	if (trace_flush(trace) != 0) {
+		log_text(LOG_ERROR, -1, "trace write failed: %s, tracing stops", strerror(errno));
+		close(trace->fd);
+		free(trace->buf);
+		free(trace);
+		trace = NULL;
+	}
+}
+
+// Append record of session \cs to the trace of the current worker
+void trace_write(struct client_state* cs, int type, const void* data, int len) {
+	struct trace* t = trace;
+	struct trace_record r;
+	long long time;
+
+	if (t->len + sizeof(r) + len > t->size) {
+		if (t->fd != -1) {
+			trace_sync();
+			if (trace == NULL) {
+				return;
+			}
+		} else {
+			char* buf = realloc(t->buf, t->size * 2 + sizeof(r) + len);
+
+			if (buf == NULL) {
+				perror("realloc failed");
+				exit(EXIT_FAILURE);
+			}
+			t->buf = buf;
+			t->size = t->size * 2 + sizeof(r) + len;
+		}
+	}
+	time = now_us() - cs->buf->trace_since;
+	r.session = cs->buf->trace_id;
+	r.time = time > UINT_MAX ? UINT_MAX : time;
+	r.len = len;
+	r.type = type;
+	r.reserved = 0;
+	memcpy(t->buf + t->len, &r, sizeof(r));
+	if (len != 0) {
+		// TRACE_OPEN has no data, it may come as NULL
+		memcpy(t->buf + t->len + sizeof(r), data, len);
+	}
+	t->len += sizeof(r) + len;
+}
+
+// Session \cs was accepted
+void trace_open(struct client_state* cs) {
+	if (trace == NULL) {
+		return;
+	}
+	cs->buf->trace_id = trace->next_id++;
+	cs->buf->trace_since = now_us();
+	trace_write(cs, TRACE_OPEN, NULL, 0);
+}
+
+// Create trace of worker \worker in file \path.<worker>
+// return value:
+//     new trace, NULL on error
+struct trace* trace_create(char* path, int worker) {
+	unsigned int version = TRACE_VERSION;
+	char name[PATH_MAX];
+	struct trace* t;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+		return NULL;
+	}
+	t->size = TRACE_BUF_SIZE;
+	t->buf = malloc(t->size);
+	if (t->buf == NULL) {
+		free(t);
+		return NULL;
+	}
+	if (path == NULL) {
+		t->fd = -1;
+		return t;
+	}
+	snprintf(name, sizeof(name), "%s.%d", path, worker);
+	t->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (t->fd == -1) {
+		perror(name);
+		free(t->buf);
+		free(t);
+		return NULL;
+	}
+	memcpy(t->buf, TRACE_MAGIC, 8);
+	memcpy(t->buf + 8, &version, sizeof(version));
+	t->len = 12;
+	return t;
+}
+
+/*
+ * Span tracing (-T). Workers time every step of a session: accept, every
+ * read, framing of messages, decoding, the next_step() decision and every
+ * reply write, and the wait for events between them. Spans are buffered
+ * per worker and written once per event loop iteration to
+ * <path>.<worker>.json as Chrome trace events: a worker is a process, a
+ * session is a thread named by its fd and username, the event loop is
+ * thread 0. Open the file in Perfetto or chrome://tracing. It is not
+ * closed by ']', which both accept
+ */
+#define SPAN_WAIT 0 // for events
+#define SPAN_ACCEPT 1
+#define SPAN_READ 2
+#define SPAN_FRAME 3 // has_terminator()
+#define SPAN_DECODE 4 // decode_*()
+#define SPAN_NEXT_STEP 5
+#define SPAN_WRITE 6
+#define SPAN_FLUSH 7 // of spans to the file
+
+char* span_names[] = {
+	[SPAN_WAIT] = "wait",
+	[SPAN_ACCEPT] = "accept",
+	[SPAN_READ] = "read",
+	[SPAN_FRAME] = "frame",
+	[SPAN_DECODE] = "decode",
+	[SPAN_NEXT_STEP] = "next_step",
+	[SPAN_WRITE] = "write",
+	[SPAN_FLUSH] = "span_flush",
+};
+
+#define SPAN_BUF_LEN 4096
+
+struct span {
+	long long start; // ns of CLOCK_MONOTONIC
+	unsigned int dur; // ns
+	unsigned int session; // span_id, 0 - event loop
+	int name; // SPAN_*
+};
+
+struct spans {
+	FILE* out;
+	int worker;
+	unsigned int next_id;
+	int len;
+	struct span buf[SPAN_BUF_LEN];
+};
+
+// Spans of the current worker, NULL if they are not recorded
+__thread struct spans* spans;
+char* spans_path;
+
+// Clock is not read unless spans are recorded
+#define SPAN_START() (spans != NULL ? now_ns() : 0)
+
+// Evaluate \expr, recording it as span \name of session \cs (NULL for
+// the event loop)
+#define SPAN(cs, name, expr) ({ \
+	long long span_start_ = SPAN_START(); \
+	__typeof__(expr) span_ret_ = (expr); \
+	if (spans != NULL) { \
+		span_add(cs, name, span_start_); \
+	} \
+	span_ret_; \
+})
+
+// Write a Chrome trace event. Events are separated by commas, the first
+// one follows '['
+void span_event(struct spans* sp, const char* fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(sp->out, fmt, ap);
+	va_end(ap);
+	fputs(",\n", sp->out);
+}
+
+void span_add(struct client_state* cs, int name, long long start);
+
+// Write out spans buffered by the current worker
+void spans_sync(void) {
+	struct spans* sp = spans;
+	struct span* s;
+	long long start;
+	int i;
+
+	if (sp == NULL || sp->len == 0) {
+		return;
+	}
+	start = now_ns();
+	for (i = 0; i < sp->len; i++) {
+		s = &sp->buf[i];
+		span_event(sp, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,"
+			   "\"ts\":%lld.%03lld,\"dur\":%u.%03u}",
+			   span_names[s->name], sp->worker, s->session,
+			   s->start / 1000, s->start % 1000, s->dur / 1000, s->dur % 1000);
+	}
+	fflush(sp->out);
+	sp->len = 0;
+	span_add(NULL, SPAN_FLUSH, start);
+}
+
+// Record span \name of session \cs (NULL for the event loop) which
+// began at \start ns and ends now
+void span_add(struct client_state* cs, int name, long long start) {
+	struct spans* sp = spans;
+	struct span* s;
+
+	if (sp->len == SPAN_BUF_LEN) {
+		spans_sync();
+	}
+	s = &sp->buf[sp->len++];
+	s->start = start;
+	s->dur = now_ns() - start;
+	s->session = cs != NULL ? cs->buf->span_id : 0;
+	s->name = name;
+}
+
+// Session \cs was accepted
+void span_open(struct client_state* cs) {
+	if (spans != NULL) {
+		cs->buf->span_id = spans->next_id++;
+	}
+}
+
+// Session \cs ends: its thread of the trace is named, now that the
+// username is known
+void span_close(struct client_state* cs) {
+	char name[USERNAME_MAXLEN * 6 + 1];
+	unsigned char c;
+	char* p = name;
+	int i;
+
+	for (i = 0; i < cs->namelen; i++) {
+		c = cs->buf->name[i];
+		if (c == '"' || c == '\\') {
+			*p++ = '\\';
+			*p++ = c;
+		} else if (c < 0x20 || c >= 0x7f) {
+			p += sprintf(p, "\\u%04x", c);
+		} else {
+			*p++ = c;
+		}
+	}
+	*p = '\0';
+	span_event(spans, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+		   "\"args\":{\"name\":\"fd %d %s\"}}",
+		   spans->worker, cs->buf->span_id, cs->fd, name);
+}
+
+// Start spans of worker \worker in file \path.<worker>.json
+// return value:
+//     new spans, NULL on error
+struct spans* spans_create(char* path, int worker) {
+	char name[PATH_MAX];
+	struct spans* sp;
+
+	sp = calloc(1, sizeof(*sp));
+	if (sp == NULL) {
+		return NULL;
+	}
+	snprintf(name, sizeof(name), "%s.%d.json", path, worker);
+	sp->out = fopen(name, "we");
+	if (sp->out == NULL) {
+		perror(name);
+		free(sp);
+		return NULL;
+	}
+	sp->worker = worker;
+	sp->next_id = 1;
+	fputs("[\n", sp->out);
+	span_event(sp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+		   "\"args\":{\"name\":\"worker %d\"}}", worker, worker);
+	span_event(sp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,"
+		   "\"args\":{\"name\":\"event loop\"}}", worker);
+	return sp;
+}
+
+// Keys used unless a key file is given (-k)
+struct {
+	int server_key;
+	int client_key;
+} authentification_keys[5] = {
+	{23019, 32037},
+	{32037, 29295},
+	{18789, 13603},
+	{16443, 29533},
+	{18189, 21952}
+};
+
+/*
+ * Key registry. Key id indexes the table directly. On SIGHUP the key file
+ * is read into a new table which replaces the current one with a single
+ * pointer store, workers never wait for it. The old table is freed once
+ * every worker passed a quiescent state (QSBR): a worker holds no table
+ * pointer while it waits for events, so it is marked offline there.
+ * Sessions which got their key id already keep their client_key
+ */
+#define KEY_ID_MAX 999
+
+struct auth_key {
+	int server_key;
+	int client_key;
+	_Bool valid;
+};
+
+struct key_table {
+	struct auth_key keys[KEY_ID_MAX + 1];
+};
+
+_Atomic(struct key_table*) key_table;
+char* key_path; // NULL: authentification_keys are used
+
+// Quiescent state of a worker: 0 while it waits for events (offline),
+// otherwise key_gen it saw when it woke up
+struct qsbr_slot {
+	_Atomic unsigned long gen;
+} __attribute__((aligned(64)));
+
+_Atomic unsigned long key_gen = 1;
+struct qsbr_slot* qsbr_slots;
+int qsbr_nslots;
+__thread struct qsbr_slot* qsbr_slot;
+
+void qsbr_offline(void) {
+	if (qsbr_slot != NULL) {
+		atomic_store(&qsbr_slot->gen, 0);
+	}
+}
+
+void qsbr_online(void) {
+	if (qsbr_slot != NULL) {
+		atomic_store(&qsbr_slot->gen, atomic_load(&key_gen));
+	}
+}
+
+// Wait until no worker can refer to a key table replaced before
+void qsbr_synchronize(void) {
+	struct timespec ts = { 0, 1000000 };
+	unsigned long gen;
+	unsigned long seen;
+	int i;
+
+	gen = atomic_fetch_add(&key_gen, 1) + 1;
+	for (i = 0; i < qsbr_nslots; i++) {
+		while ((seen = atomic_load(&qsbr_slots[i].gen)) != 0 && seen < gen) {
+			nanosleep(&ts, NULL);
+		}
+	}
+}
+
+// Read key file \path. Each line is "<id> <server key> <client key>",
+// empty lines and lines starting with '#' are skipped
+// return value:
+//     new table, NULL if file can not be read or is malformed
+struct key_table* keys_load(char* path) {
+	struct key_table* t;
+	char line[256];
+	char* p;
+	FILE* f;
+	int lineno = 0;
+	int server_key;
+	int client_key;
+	int id;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		log_text(LOG_ERROR, -1, "can not open key file %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+		fclose(f);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		for (p = line; isspace((unsigned char)*p); p++)
+			;
+		if (*p == '\0' || *p == '#') {
+			continue;
+		}
+		if (sscanf(p, "%d %d %d", &id, &server_key, &client_key) != 3 ||
+		    id < 0 || id > KEY_ID_MAX || server_key < 0 || server_key > 65535 ||
+		    client_key < 0 || client_key > 65535) {
+			log_text(LOG_ERROR, -1, "%s:%d: bad key", path, lineno);
+			fclose(f);
+			free(t);
+			return NULL;
+		}
+		t->keys[id].server_key = server_key;
+		t->keys[id].client_key = client_key;
+		t->keys[id].valid = true;
+	}
+	fclose(f);
+	return t;
+}
+
+// Reload key file on SIGHUP. SIGHUP is blocked in all threads, this one
+// takes it with sigwait()
+void* keys_reloader(void* arg) {
+	struct key_table* t;
+	sigset_t set;
+	int sig;
+
+	(void)arg;
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	while (1) {
+		if (sigwait(&set, &sig) != 0) {
+			continue;
+		}
+		if (key_path == NULL) {
+			log_text(LOG_WARN, -1, "SIGHUP: no key file to reload");
+			continue;
+		}
+		t = keys_load(key_path);
+		if (t == NULL) {
+			log_text(LOG_ERROR, -1, "SIGHUP: keys are not reloaded");
+			continue;
+		}
+		t = atomic_exchange(&key_table, t);
+		qsbr_synchronize();
+		free(t);
+		log_text(LOG_INFO, -1, "keys reloaded from %s", key_path);
+	}
+	return NULL;
+}
+
+// Load keys, from key_path if set, and start reloader for \nworkers
+// workers. Call before any thread is created: they inherit blocked SIGHUP
+void keys_init(int nworkers) {
+	struct key_table* t;
+	pthread_t thread;
+	sigset_t set;
+	int rc;
+	int i;
+
+	if (key_path != NULL) {
+		t = keys_load(key_path);
+		if (t == NULL) {
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		t = calloc(1, sizeof(*t));
+		if (t == NULL) {
+			perror("calloc failed");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < 5; i++) {
+			t->keys[i].server_key = authentification_keys[i].server_key;
+			t->keys[i].client_key = authentification_keys[i].client_key;
+			t->keys[i].valid = true;
+		}
+	}
+	atomic_store(&key_table, t);
+
+	qsbr_slots = aligned_alloc(64, nworkers * sizeof(qsbr_slots[0]));
+	if (qsbr_slots == NULL) {
+		perror("aligned_alloc failed");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < nworkers; i++) {
+		atomic_init(&qsbr_slots[i].gen, 0);
+	}
+	qsbr_nslots = nworkers;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	rc = pthread_create(&thread, NULL, keys_reloader, NULL);
+	if (rc != 0) {
+		fprintf(stderr, "pthread_create failed: %s\n", strerror(rc));
+		exit(EXIT_FAILURE);
+	}
+}
+
+int get_hash(char* name, int namelen) {
+	int sum = 0;
+	int i;
+
+	// bytes are unsigned: a name with chars above 127 must not get a
+	// negative hash
+	for (i = 0; i < namelen; i++) {
+		sum += (unsigned char)name[i];
+	}
+	sum *= 1000;
+	sum %= 65536;
+
+	return sum;
+}
+
+/*
+ * io_uring engine. Accepts are multishot, recvs are multishot into
+ * buffers the kernel picks from a provided buffer ring, replies go out as
+ * one IORING_OP_SENDMSG and the final one is hard-linked with shutdown.
+ * Rings are driven with raw syscalls, liburing is not needed
+ */
+#define URING_ENTRIES 4096
+#define URING_NBUFS 1024 // provided recv buffers, power of 2
+#define URING_BUFSIZE 1024
+#define URING_BGID 0
+
+// Operation is kept in low bits of user_data: sessions are 64 bytes
+// aligned. Accept has no session
+#define URING_OP_ACCEPT 0
+#define URING_OP_RECV 1
+#define URING_OP_SEND 2
+#define URING_OP_SHUTDOWN 3
+#define URING_OP_WAKE 4 // worker is woken up through its eventfd
+#define URING_OP_CANCEL 5
+#define URING_OP_ACCEPT_UNIX 6 // accept on the unix listener
+#define URING_OP_MASK 63
+
+// client_buf.closing
+#define URING_CLOSE_REQUESTED 1 // shutdown waits for the send in flight
+#define URING_CLOSE_SHUTDOWN 2
+
+struct uring {
+	int fd;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sqe_tail; // SQEs prepared, published to *sq_tail on submit
+	struct io_uring_sqe* sqes;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+	struct io_uring_buf_ring* br;
+	unsigned short br_tail;
+	char* bufs;
+	int multishot_recv; // cleared if kernel rejects IORING_RECV_MULTISHOT
+	int accept_single; // bits 1 << URING_OP_ACCEPT*: kernel rejected
+			   // IORING_ACCEPT_MULTISHOT, one accept at a time
+	int draining; // no more accepts, loop ends when the last session does
+	void* ring;
+	size_t ring_size;
+	size_t sqes_size;
+};
+
+// io_uring of the worker running in the current thread, NULL if the
+// worker uses epoll
+__thread struct uring* uring;
+
+void uring_destroy(struct uring* u) {
+	if (u->br != NULL) {
+		munmap(u->br, URING_NBUFS * sizeof(struct io_uring_buf));
+	}
+	free(u->bufs);
+	if (u->sqes != NULL) {
+		munmap(u->sqes, u->sqes_size);
+	}
+	if (u->ring != NULL) {
+		munmap(u->ring, u->ring_size);
+	}
+	close(u->fd);
+	free(u);
+}
+
+// Give recv buffer \bid back to the kernel
+void uring_recycle(struct uring* u, int bid) {
+	struct io_uring_buf* b;
+
+	b = &u->br->bufs[u->br_tail & (URING_NBUFS - 1)];
+	b->addr = (unsigned long)(u->bufs + bid * URING_BUFSIZE);
+	b->len = URING_BUFSIZE;
+	b->bid = bid;
+	u->br_tail++;
+	atomic_store_explicit((_Atomic unsigned short *)&u->br->tail, u->br_tail,
+			      memory_order_release);
+}
+
+// return value:
+//     new io_uring, NULL if kernel does not support what the engine needs
+struct uring* uring_setup(void) {
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	struct uring* u;
+	int i;
+
+	u = calloc(1, sizeof(*u));
+	if (u == NULL) {
+		return NULL;
+	}
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (u->fd == -1) {
+		free(u);
+		return NULL;
+	}
+	// Single mmap of both rings and waiting with timeout (5.11)
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+		uring_destroy(u);
+		return NULL;
+	}
+	u->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > u->ring_size) {
+		u->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	}
+	u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->ring == MAP_FAILED) {
+		u->ring = NULL;
+		uring_destroy(u);
+		return NULL;
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		uring_destroy(u);
+		return NULL;
+	}
+	u->sq_head = (unsigned*)((char*)u->ring + p.sq_off.head);
+	u->sq_tail = (unsigned*)((char*)u->ring + p.sq_off.tail);
+	u->sq_mask = *(unsigned*)((char*)u->ring + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	// SQ array maps ring slots to SQEs one to one
+	for (i = 0; i < (int)p.sq_entries; i++) {
+		((unsigned*)((char*)u->ring + p.sq_off.array))[i] = i;
+	}
+	u->cq_head = (unsigned*)((char*)u->ring + p.cq_off.head);
+	u->cq_tail = (unsigned*)((char*)u->ring + p.cq_off.tail);
+	u->cq_mask = *(unsigned*)((char*)u->ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*)((char*)u->ring + p.cq_off.cqes);
+
+	// Provided buffer ring (5.19)
+	u->br = mmap(NULL, URING_NBUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->br == MAP_FAILED) {
+		u->br = NULL;
+		uring_destroy(u);
+		return NULL;
+	}
+	u->bufs = malloc(URING_NBUFS * URING_BUFSIZE);
+	if (u->bufs == NULL) {
+		uring_destroy(u);
+		return NULL;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)u->br;
+	reg.ring_entries = URING_NBUFS;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		uring_destroy(u);
+		return NULL;
+	}
+	for (i = 0; i < URING_NBUFS; i++) {
+		uring_recycle(u, i);
+	}
+	u->multishot_recv = 1;
+	return u;
+}
+
+// Pass prepared SQEs to the kernel and wait for a completion at most
+// \timeout ms: -1 - no limit, 0 - do not wait
+void uring_submit(struct uring* u, int timeout) {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags = 0;
+	unsigned wait = 0;
+	unsigned n;
+	int rc;
+
+	atomic_store_explicit((_Atomic unsigned *)u->sq_tail, u->sqe_tail, memory_order_release);
+	n = u->sqe_tail - atomic_load_explicit((_Atomic unsigned *)u->sq_head, memory_order_acquire);
+	if (n == 0 && timeout == 0) {
+		// Completions are polled from the ring, no need to enter
+		return;
+	}
+	memset(&arg, 0, sizeof(arg));
+	if (timeout != 0) {
+		flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		wait = 1;
+		if (timeout > 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000LL;
+			arg.ts = (unsigned long)&ts;
+		}
+	}
+	rc = syscall(__NR_io_uring_enter, u->fd, n, wait, flags, &arg, sizeof(arg));
+	// EBUSY, EAGAIN: completions or kernel memory have to be freed
+	// first, which the event loop does
+	if (rc == -1 && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+		perror("io_uring_enter failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+struct io_uring_sqe* uring_get_sqe(struct uring* u) {
+	struct io_uring_sqe* sqe;
+
+	while (u->sqe_tail - atomic_load_explicit((_Atomic unsigned *)u->sq_head,
+						  memory_order_acquire) == u->sq_entries) {
+		// SQ is full, let the kernel consume it
+		uring_submit(u, 0);
+	}
+	sqe = &u->sqes[u->sqe_tail & u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sqe_tail++;
+	return sqe;
+}
+
+// Accept on listener \socket_fd, completions come as \op
+void uring_accept(struct uring* u, int socket_fd, int op) {
+	struct io_uring_sqe* sqe = uring_get_sqe(u);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = socket_fd;
+	if (!(u->accept_single & 1 << op)) {
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	}
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = op;
+}
+
+// Stop accepting: cancel multishot accept \op
+void uring_cancel_accept(struct uring* u, int op) {
+	struct io_uring_sqe* sqe = uring_get_sqe(u);
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = op;
+	sqe->user_data = URING_OP_CANCEL;
+}
+
+// Get a completion when eventfd \fd is written
+void uring_poll_wake(struct uring* u, int fd) {
+	struct io_uring_sqe* sqe = uring_get_sqe(u);
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = URING_OP_WAKE;
+}
+
+void uring_recv(struct uring* u, struct client_state* cs) {
+	struct io_uring_sqe* sqe = uring_get_sqe(u);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = cs->fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	if (u->multishot_recv) {
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+	} else {
+		sqe->len = URING_BUFSIZE;
+	}
+	sqe->user_data = (unsigned long)cs | URING_OP_RECV;
+	cs->buf->inflight++;
+}
+
+// Start sending queued replies of \cs unless a send is in flight already
+// return value:
+//     SQE of the send, NULL if nothing was started
+struct io_uring_sqe* uring_send(struct uring* u, struct client_state* cs) {
+	struct client_buf* b = cs->buf;
+	struct io_uring_sqe* sqe;
+
+	if (b->sending || cs->outq_sent == cs->outq_len) {
+		return NULL;
+	}
+	memset(&b->send_msg, 0, sizeof(b->send_msg));
+	b->send_msg.msg_iov = b->outq + cs->outq_sent;
+	b->send_msg.msg_iovlen = cs->outq_len - cs->outq_sent;
+	b->send_end = cs->outq_len;
+	sqe = uring_get_sqe(u);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = cs->fd;
+	sqe->addr = (unsigned long)&b->send_msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (unsigned long)cs | URING_OP_SEND;
+	b->sending = 1;
+	b->inflight++;
+	return sqe;
+}
+
+void uring_shutdown(struct uring* u, struct client_state* cs) {
+	struct io_uring_sqe* sqe = uring_get_sqe(u);
+
+	cs->buf->closing = URING_CLOSE_SHUTDOWN;
+	sqe->opcode = IORING_OP_SHUTDOWN;
+	sqe->fd = cs->fd;
+	sqe->len = SHUT_RDWR;
+	sqe->user_data = (unsigned long)cs | URING_OP_SHUTDOWN;
+	cs->buf->inflight++;
+}
+
+// Close session \cs after the final reply is sent. Shutdown also ends
+// the multishot recv; the session is freed once the kernel has completed
+// all its operations
+void uring_close(struct uring* u, struct client_state* cs) {
+	struct io_uring_sqe* sqe;
+
+	cs->buf->closing = URING_CLOSE_REQUESTED;
+	sqe = uring_send(u, cs);
+	if (sqe != NULL) {
+		// shutdown even if the send fails
+		sqe->flags |= IOSQE_IO_HARDLINK;
+		uring_shutdown(u, cs);
+	} else if (!cs->buf->sending) {
+		uring_shutdown(u, cs);
+	}
+	// otherwise shutdown follows completion of the send in flight
+}
+
+// Send queued replies of \cs with a single sendmsg()
+// return value:
+//     0 if replies are sent or the socket buffer is full (the rest is sent
+//       when EPOLLOUT is reported)
+//     -1 if connection is broken
+int flush_replies(struct client_state* cs) {
+	struct iovec* iov = cs->buf->outq;
+	struct msghdr mh;
+	ssize_t rc;
+
+	if (uring != NULL) {
+		uring_send(uring, cs);
+		return 0;
+	}
+	if (cs->fd == -1) {
+		// Replayed session has no socket, replies are in the trace
+		cs->outq_len = 0;
+		cs->outq_sent = 0;
+		return 0;
+	}
+	while (cs->outq_sent < cs->outq_len) {
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov + cs->outq_sent;
+		mh.msg_iovlen = cs->outq_len - cs->outq_sent;
+		// MSG_NOSIGNAL: robot which closed connection must not kill server
+		rc = SPAN(cs, SPAN_WRITE, sendmsg(cs->fd, &mh, MSG_NOSIGNAL));
+		if (rc == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			return -1;
+		}
+		METRIC_ADD(metrics->bytes_out, rc);
+		// Drop sent replies, trim partially sent one
+		while (rc > 0) {
+			if ((size_t)rc >= iov[cs->outq_sent].iov_len) {
+				rc -= iov[cs->outq_sent].iov_len;
+				cs->outq_sent++;
+				continue;
+			}
+			iov[cs->outq_sent].iov_base = (char*)iov[cs->outq_sent].iov_base + rc;
+			iov[cs->outq_sent].iov_len -= rc;
+			rc = 0;
+		}
+	}
+	cs->outq_len = 0;
+	cs->outq_sent = 0;
+	return 0;
+}
+
+// Make room in output queue of \cs by sending what the socket takes now
+// return value:
+//     number of free entries, 0 if the robot has yet to take replies or
+//       a send is in flight
+//     -1 if connection is broken
+int outq_room(struct client_state* cs) {
+	struct iovec* iov = cs->buf->outq;
+
+	if (flush_replies(cs) != 0) {
+		return -1;
+	}
+	// entries of a send in flight must stay in place
+	if (cs->outq_sent != 0 && !cs->buf->sending) {
+		memmove(iov, iov + cs->outq_sent,
+			(cs->outq_len - cs->outq_sent) * sizeof(iov[0]));
+		cs->outq_len -= cs->outq_sent;
+		cs->outq_sent = 0;
+	}
+	return OUTQ_LEN - cs->outq_len;
+}
+
+// Append \msg to output queue of \cs. \msg has to stay valid until sent
+// return value:
+//     0 if queued
+//     -1 if queue is full and robot does not read replies or connection is broken
+int queue_reply(struct client_state* cs, char* msg) {
+	struct iovec* iov = cs->buf->outq;
+
+	if (cs->outq_len == OUTQ_LEN && outq_room(cs) <= 0) {
+		return -1;
+	}
+	iov[cs->outq_len].iov_base = msg;
+	iov[cs->outq_len].iov_len = strlen(msg);
+	cs->outq_len++;
+	if (trace != NULL) {
+		trace_write(cs, TRACE_OUT, msg, iov[cs->outq_len - 1].iov_len);
+	}
+	return 0;
+}
+
+/*
+ * Navigation. Unless a known obstacle lies between the robot and (0, 0),
+ * any path which only reduces distance is free and the greedy step is
+ * optimal. Otherwise the next command is chosen by A* search over
+ * (x, y, direction) states where each command costs 1, known obstacles
+ * are blocked and other cells are assumed free. As every command is a
+ * round trip to the robot, search time is well spent
+ */
+#define CMD_MOVE 0
+#define CMD_TURN_LEFT 1
+#define CMD_TURN_RIGHT 2
+#define CMD_NONE 3
+
+char* cmd_replies[] = {
+	[CMD_MOVE] = SERVER_MOVE,
+	[CMD_TURN_LEFT] = SERVER_TURN_LEFT,
+	[CMD_TURN_RIGHT] = SERVER_TURN_RIGHT,
+};
+
+_Bool is_obstacle(struct client_state* cs, int x, int y) {
+	int i;
+
+	for (i = 0; i < cs->nobstacles; i++) {
+		if (cs->buf->obstacles[i][0] == x && cs->buf->obstacles[i][1] == y) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void add_obstacle(struct client_state* cs, int x, int y) {
+	int i;
+
+	if (is_obstacle(cs, x, y)) {
+		return;
+	}
+	if (cs->nobstacles < PLAN_MAX_OBSTACLES) {
+		i = cs->nobstacles++;
+	} else {
+		i = cs->buf->obstacle_next;
+		cs->buf->obstacle_next = (i + 1) % PLAN_MAX_OBSTACLES;
+	}
+	cs->buf->obstacles[i][0] = x;
+	cs->buf->obstacles[i][1] = y;
+}
+
+// Does moving in direction \d bring robot at \x, \y closer to (0, 0)
+_Bool is_productive(int x, int y, int d) {
+	return dir_dx[d] * x < 0 || dir_dy[d] * y < 0;
+}
+
+// return value:
+//     number of commands robot at \x, \y heading \d needs to reach (0, 0)
+//     when there are no obstacles
+int free_cost(int x, int y, int d) {
+	int cost = abs(x) + abs(y);
+
+	if (cost == 0) {
+		return 0;
+	}
+	if (x != 0 && y != 0) {
+		// Two legs: a turn between them and one more if heading along neither
+		return cost + (is_productive(x, y, d) ? 1 : 2);
+	}
+	if (is_productive(x, y, d)) {
+		return cost;
+	}
+	if (is_productive(x, y, dir_left[d]) || is_productive(x, y, dir_right[d])) {
+		return cost + 1;
+	}
+	return cost + 2;
+}
+
+// Optimal command if there are no obstacles: move while it reduces
+// distance, otherwise turn towards (0, 0)
+int greedy_cmd(struct client_state* cs) {
+	if (is_productive(cs->x, cs->y, cs->direction)) {
+		return CMD_MOVE;
+	}
+	if (is_productive(cs->x, cs->y, dir_left[cs->direction])) {
+		return CMD_TURN_LEFT;
+	}
+	return CMD_TURN_RIGHT;
+}
+
+// Is any known obstacle in the rectangle between the robot and (0, 0)
+_Bool obstacle_in_way(struct client_state* cs) {
+	int i;
+	int ox;
+	int oy;
+
+	for (i = 0; i < cs->nobstacles; i++) {
+		ox = cs->buf->obstacles[i][0];
+		oy = cs->buf->obstacles[i][1];
+		if (ox >= (cs->x < 0 ? cs->x : 0) && ox <= (cs->x > 0 ? cs->x : 0) &&
+		    oy >= (cs->y < 0 ? cs->y : 0) && oy <= (cs->y > 0 ? cs->y : 0)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+#define PLAN_MAX_NODES 2048 // expanded per decision
+#define PLAN_TABLE_SIZE 8192 // power of 2, > 3 * PLAN_MAX_NODES
+#define PLAN_HEAP_SIZE (3 * PLAN_MAX_NODES + 1)
+
+struct plan_node {
+	int x;
+	int y;
+	unsigned int gen; // node belongs to search plan_gen only
+	unsigned short g; // commands from the start
+	unsigned char d;
+	unsigned char first; // CMD_* the path to the node starts with
+};
+
+struct plan_entry {
+	unsigned short f; // g + free_cost()
+	unsigned short g;
+	unsigned short node;
+};
+
+// Search state of the worker. Generation stamp makes clearing the node
+// table unnecessary
+__thread struct plan_node plan_nodes[PLAN_TABLE_SIZE];
+__thread unsigned int plan_gen;
+__thread struct plan_entry plan_heap[PLAN_HEAP_SIZE];
+__thread int plan_heap_len;
+
+// return value:
+//     index of node of state \x, \y, \d in plan_nodes, -1 if table is full
+int plan_node(int x, int y, int d) {
+	unsigned int h;
+	int i;
+
+	h = ((unsigned int)x * 73856093u) ^ ((unsigned int)y * 19349663u) ^ (d * 83492791u);
+	for (i = 0; i < PLAN_TABLE_SIZE; i++) {
+		struct plan_node* n = &plan_nodes[(h + i) & (PLAN_TABLE_SIZE - 1)];
+
+		if (n->gen != plan_gen) {
+			n->gen = plan_gen;
+			n->x = x;
+			n->y = y;
+			n->d = d;
+			n->g = USHRT_MAX;
+			return n - plan_nodes;
+		}
+		if (n->x == x && n->y == y && n->d == d) {
+			return n - plan_nodes;
+		}
+	}
+	return -1;
+}
+
+// Entry a precedes b: lower f first, deeper one on tie
+#define PLAN_BEFORE(a, b) ((a).f < (b).f || ((a).f == (b).f && (a).g > (b).g))
+
+void plan_push(int f, int g, int node) {
+	struct plan_entry e = { f, g, node };
+	int i = plan_heap_len++;
+
+	while (i > 0 && PLAN_BEFORE(e, plan_heap[(i - 1) / 2])) {
+		plan_heap[i] = plan_heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	plan_heap[i] = e;
+}
+
+struct plan_entry plan_pop(void) {
+	struct plan_entry top = plan_heap[0];
+	struct plan_entry e = plan_heap[--plan_heap_len];
+	int i = 0;
+	int c;
+
+	while ((c = 2 * i + 1) < plan_heap_len) {
+		if (c + 1 < plan_heap_len && PLAN_BEFORE(plan_heap[c + 1], plan_heap[c])) {
+			c++;
+		}
+		if (!PLAN_BEFORE(plan_heap[c], e)) {
+			break;
+		}
+		plan_heap[i] = plan_heap[c];
+		i = c;
+	}
+	plan_heap[i] = e;
+	return top;
+}
+
+// A* from the robot state to (0, 0)
+// return value:
+//     CMD_* to be sent to the robot. If search gives up, the first command
+//     towards the most promising state seen
+int plan_cmd(struct client_state* cs) {
+	struct plan_entry e;
+	struct plan_node* n;
+	int best;
+	int best_h;
+	int expanded = 0;
+	int start;
+	int next;
+	int cmd;
+	int nx;
+	int ny;
+	int nd;
+	int h;
+
+	if (++plan_gen == 0) {
+		plan_gen = 1;
+	}
+	plan_heap_len = 0;
+	start = plan_node(cs->x, cs->y, cs->direction);
+	plan_nodes[start].g = 0;
+	plan_nodes[start].first = CMD_NONE;
+	best = start;
+	best_h = free_cost(cs->x, cs->y, cs->direction);
+	plan_push(best_h, 0, start);
+
+	while (plan_heap_len > 0 && expanded < PLAN_MAX_NODES) {
+		e = plan_pop();
+		n = &plan_nodes[e.node];
+		if (e.g != n->g) {
+			// stale entry, node was reached cheaper since
+			continue;
+		}
+		if (n->x == 0 && n->y == 0) {
+			return n->first;
+		}
+		expanded++;
+		if (e.f - e.g < best_h) {
+			best_h = e.f - e.g;
+			best = e.node;
+		}
+		for (cmd = CMD_MOVE; cmd <= CMD_TURN_RIGHT; cmd++) {
+			nx = n->x;
+			ny = n->y;
+			nd = n->d;
+			if (cmd == CMD_MOVE) {
+				nx += dir_dx[nd];
+				ny += dir_dy[nd];
+				if (is_obstacle(cs, nx, ny)) {
+					continue;
+				}
+			} else if (cmd == CMD_TURN_LEFT) {
+				nd = dir_left[nd];
+			} else {
+				nd = dir_right[nd];
+			}
+			next = plan_node(nx, ny, nd);
+			if (next == -1) {
+				goto give_up;
+			}
+			if (n->g + 1 >= plan_nodes[next].g) {
+				continue;
+			}
+			plan_nodes[next].g = n->g + 1;
+			plan_nodes[next].first = n->first == CMD_NONE ? cmd : n->first;
+			h = free_cost(nx, ny, nd);
+			plan_push(n->g + 1 + h, n->g + 1, next);
+		}
+	}
+give_up:
+	if (plan_nodes[best].first == CMD_NONE) {
+		return greedy_cmd(cs);
+	}
+	return plan_nodes[best].first;
+}
+
+// Send robot the next command on its way to (0, 0)
+// return 0 on success
+//        1 if reply can not be queued
+int next_step(struct client_state* cs) {
+	int cmd;
+
+	if (cs->nobstacles != 0 && obstacle_in_way(cs)) {
+		cmd = plan_cmd(cs);
+	} else {
+		cmd = greedy_cmd(cs);
+	}
+	if (cmd == CMD_TURN_LEFT) {
+		cs->direction = dir_left[cs->direction];
+	} else if (cmd == CMD_TURN_RIGHT) {
+		cs->direction = dir_right[cs->direction];
+	}
+
+	if (queue_reply(cs, cmd_replies[cmd]) != 0) {
+		return 1;
+	}
+
+	cs->was_move = cmd == CMD_MOVE;
+	
+	return 0;
+}
+
+void print_client_msg(struct client_state* cs, char* msg, int msg_len) {
+	if (LOG_ENABLED(LOG_DEBUG)) {
+		log_event(LOG_DEBUG, LOG_EV_MESSAGE, cs->fd, msg, msg_len);
+	}
+}
+
+// Forget session \cs which ends for \reason END_*. close() also drops
+// its fd from the epoll set
+void close_client(struct client_state* cs, int reason) {
+	unsigned char end = reason;
+
+	metrics_session_end(cs, reason);
+	if (trace != NULL) {
+		trace_write(cs, TRACE_CLOSE, &end, 1);
+	}
+	if (spans != NULL) {
+		span_close(cs);
+	}
+	if (uring != NULL) {
+		timer_cancel(cs);
+		uring_close(uring, cs);
+		return;
+	}
+	// Last reply (error or SERVER_LOGOUT) is still queued. It is only
+	// sent if the socket takes it at once
+	flush_replies(cs);
+	if (cs->fd != -1) {
+		close(cs->fd);
+	}
+	timer_cancel(cs);
+	session_free(cs);
+}
+
+// Close sessions of \q whose deadline passed
+void expire_sessions(struct timer_queue* q, long long now) {
+	while (q->head != NULL && q->head->deadline <= now) {
+		close_client(q->head, END_TIMEOUT);
+	}
+}
+
+// Close sessions of the worker whose deadline passed
+void timers_expire(long long now) {
+	expire_sessions(&session_timers, now);
+	expire_sessions(&recharging_timers, now);
+}
+
+// Outcome of a message handler. Anything but STEP_CONTINUE ends the
+// session
+#define STEP_CONTINUE 0
+#define STEP_SYNTAX_ERROR 1
+#define STEP_LOGIN_FAILED 2
+#define STEP_KEY_OUT_OF_RANGE 3
+#define STEP_LOGOUT 4 // robot is done, SERVER_LOGOUT is queued
+#define STEP_CLOSE 5 // connection is broken or robot does not read replies
+#define STEP_LOGIC_ERROR 6
+#define STEP_NO_PROGRESS 7 // closed without reply, like a timeout
+#define STEP_INTERNAL_ERROR 8 // bug, only the session is lost
+
+// Why session ends, indexed by STEP_*
+int step_ends[] = {
+	[STEP_SYNTAX_ERROR] = END_SYNTAX_ERROR,
+	[STEP_LOGIN_FAILED] = END_LOGIN_FAILED,
+	[STEP_KEY_OUT_OF_RANGE] = END_KEY_OUT_OF_RANGE,
+	[STEP_LOGOUT] = END_LOGOUT,
+	[STEP_CLOSE] = END_CLOSED,
+	[STEP_LOGIC_ERROR] = END_LOGIC_ERROR,
+	[STEP_NO_PROGRESS] = END_NO_PROGRESS,
+	[STEP_INTERNAL_ERROR] = END_INTERNAL_ERROR,
+};
+
+// Final reply sent before closing, indexed by STEP_*
+char* step_replies[] = {
+	[STEP_CONTINUE] = NULL,
+	[STEP_SYNTAX_ERROR] = SERVER_SYNTAX_ERROR,
+	[STEP_LOGIN_FAILED] = SERVER_LOGIN_FAILED,
+	[STEP_KEY_OUT_OF_RANGE] = SERVER_KEY_OUT_OF_RANGE_ERROR,
+	[STEP_LOGOUT] = NULL,
+	[STEP_CLOSE] = NULL,
+	[STEP_LOGIC_ERROR] = SERVER_LOGIC_ERROR,
+	[STEP_NO_PROGRESS] = NULL,
+	[STEP_INTERNAL_ERROR] = NULL,
+};
+
+// Message handlers. Each gets a complete message \cmd of \cmd_len bytes
+// (including "\a\b") received in the state it handles, queues replies
+// and returns STEP_*
+
+int handle_username(struct client_state* cs, char* cmd, int cmd_len) {
+	int textlen;
+
+	// Check that client send CLIENT_USERNAME message
+	if (!SPAN(cs, SPAN_DECODE, decode_client_text(cmd_len, USERNAME_MAXLEN, &textlen))) {
+		return STEP_SYNTAX_ERROR;
+	}
+	cs->namelen = textlen;
+	memcpy(cs->buf->name, cmd, textlen);
+	if (queue_reply(cs, SERVER_KEY_REQUEST) != 0) {
+		return STEP_CLOSE;
+	}
+	cs->state = EXPECT_KEY_ID;
+	return STEP_CONTINUE;
+}
+
+int handle_key_id(struct client_state* cs, char* cmd, int cmd_len) {
+	struct auth_key* key;
+	int hash;
+	int key_id;
+	char* tmp = cs->buf->key_reply;
+
+	if (cmd_len > KEYID_MAXLEN ||
+	    !SPAN(cs, SPAN_DECODE, decode_client_keyid_confirm(cmd, KEY_ID_MAX, &key_id))) {
+		return STEP_SYNTAX_ERROR;
+	}
+	key = &atomic_load_explicit(&key_table, memory_order_acquire)->keys[key_id];
+	if (!key->valid) {
+		return STEP_KEY_OUT_OF_RANGE;
+	}
+
+	// Compose reply to the client
+	hash = get_hash(cs->buf->name, cs->namelen);
+	hash += key->server_key;
+	hash %= 65536;
+	snprintf(tmp, sizeof(cs->buf->key_reply), "%d\a\b", hash);
+	if (queue_reply(cs, tmp) != 0) {
+		return STEP_CLOSE;
+	}
+	cs->state = EXPECT_CONFIRMATION;
+	cs->client_key = key->client_key;
+	return STEP_CONTINUE;
+}
+
+int handle_confirmation(struct client_state* cs, char* cmd, int cmd_len) {
+	int code;
+
+	if (cmd_len > CONFIRMATION_MAXLEN ||
+	    !SPAN(cs, SPAN_DECODE, decode_client_keyid_confirm(cmd, 65535, &code))) {
+		return STEP_SYNTAX_ERROR;
+	}
+	// Check confirmation code: restore hash value
+	code += 65536;
+	code -= cs->client_key;
+	code %= 65536;
+	if (code != get_hash(cs->buf->name, cs->namelen)) {
+		return STEP_LOGIN_FAILED;
+	}
+	// Initialize unknown position and orientation
+	cs->x = X_UNKNOWN;
+	cs->y = Y_UNKNOWN;
+	cs->direction = DIRECTION_UNKNOWN;
+
+	// Send first of moves to detect current location
+	if (queue_reply(cs, SERVER_OK) != 0 || queue_reply(cs, SERVER_MOVE) != 0) {
+		return STEP_CLOSE;
+	}
+	cs->was_move = 1;
+	cs->state = EXPECT_CLIENT_OK;
+	return STEP_CONTINUE;
+}
+
+// Client response to MOVE and ROTATE is recieved
+int handle_client_ok(struct client_state* cs, char* cmd, int cmd_len) {
+	int x;
+	int y;
+	int d;
+	int k;
+	int n;
+
+	// Framing lets RECHARGING run to RECHARGING_LEN. OK is held to its
+	// own limit, whatever that one is
+	if (cmd_len > CLIENT_OK_MAXLEN ||
+	    !SPAN(cs, SPAN_DECODE, decode_client_ok(cmd, &x, &y))) {
+		return STEP_SYNTAX_ERROR;
+	}
+	// Every OK answers a command
+	cs->buf->commands++;
+	if (x == 0 && y == 0) {
+		// Target is reached
+		if (queue_reply(cs, SERVER_PICK_UP) != 0) {
+			return STEP_CLOSE;
+		}
+		cs->state = EXPECT_CLIENT_MSG;
+		return STEP_CONTINUE;
+	}
+	if (cs->x == X_UNKNOWN) {
+		// Position and orientation were unknown, now pos is known
+		cs->x = x;
+		cs->y = y;
+		if (queue_reply(cs, SERVER_MOVE) != 0) {
+			return STEP_CLOSE;
+		}
+		cs->was_move = 1;
+		// State remains EXPECT_CLIENT_OK
+		return STEP_CONTINUE;
+	}
+	if (cs->direction == DIRECTION_UNKNOWN) {
+		// Position is known, orientation is not
+		if (cs->x == x && cs->y == y) {
+			if (cs->was_move) {
+				// Move did not change position: try another heading
+				cs->blocked |= 1 << (cs->did_turn & 3);
+				if (queue_reply(cs, SERVER_TURN_RIGHT) != 0) {
+					return STEP_CLOSE;
+				}
+				// Count on past 3, so that the replay below knows every
+				// heading has a bit, but keep it in a char
+				cs->did_turn++;
+				if (cs->did_turn == 8) {
+					cs->did_turn = 4;
+				}
+				cs->was_move = 0;
+			} else {
+				if (queue_reply(cs, SERVER_MOVE) != 0) {
+					return STEP_CLOSE;
+				}
+				cs->was_move = 1;
+			}
+			// State remains the same
+			return STEP_CONTINUE;
+		}
+		if (cs->x == x) {
+			// Robot orientation is vertical
+			if (cs->y < y) {
+				// Direction is up
+				cs->direction = DIRECTION_UP;
+			} else {
+				// Direction is down
+				cs->direction = DIRECTION_DOWN;
+			}
+		}
+		if (cs->y == y) {
+			// Robot orientation is horizontal
+			if (cs->x < x) {
+				// Direction is right
+				cs->direction = DIRECTION_RIGHT;
+			} else {
+				// Direction is left
+				cs->direction = DIRECTION_LEFT;
+			}
+		}
+		// Headings blocked before the right turns are known now. The 4th
+		// one back is the heading just moved along
+		n = cs->did_turn < 3 ? cs->did_turn : 3;
+		d = cs->direction;
+		for (k = 1; k <= n; k++) {
+			d = dir_left[d];
+			if (cs->blocked & (1 << ((cs->did_turn - k) & 3))) {
+				add_obstacle(cs, cs->x + dir_dx[d], cs->y + dir_dy[d]);
+			}
+		}
+	} else if (cs->x == x && cs->y == y && cs->was_move) {
+		// Stuck on obstacle
+		add_obstacle(cs, x + dir_dx[cs->direction], y + dir_dy[cs->direction]);
+	}
+
+	// Update coordinates
+	cs->x = x;
+	cs->y = y;
+	if (SPAN(cs, SPAN_NEXT_STEP, next_step(cs)) != 0) {
+		return STEP_CLOSE;
+	}
+	return STEP_CONTINUE;
+}
+
+int handle_client_message(struct client_state* cs, char* cmd, int cmd_len) {
+	int textlen;
+
+	// The text itself is not used, only its length
+	(void)cmd;
+	if (!SPAN(cs, SPAN_DECODE, decode_client_text(cmd_len, CLIENTMSG_MAXLEN, &textlen))) {
+		return STEP_SYNTAX_ERROR;
+	}
+	if (queue_reply(cs, SERVER_LOGOUT) != 0) {
+		return STEP_CLOSE;
+	}
+	// Done with the the client
+	return STEP_LOGOUT;
+}
+
+// Robot which sent RECHARGING is parked: it is moved to the queue of
+// recharging robots and nothing is done for it until it sends FULL POWER
+// or its deadline passes
+int park_session(struct client_state* cs) {
+	cs->buf->parked_state = cs->state;
+	cs->state = EXPECT_FULL_POWER;
+	timer_arm(&recharging_timers, cs);
+	return STEP_CONTINUE;
+}
+
+int handle_full_power(struct client_state* cs, char* cmd, int cmd_len) {
+	if (cmd_len != RECHARGING_LEN ||
+	    memcmp(cmd, CLIENT_FULL_POWER_MSG, RECHARGING_LEN) != 0) {
+		return STEP_LOGIC_ERROR;
+	}
+	// Session continues exactly where it was. It is back in
+	// session_timers already, as after any message
+	cs->state = cs->buf->parked_state;
+	return STEP_CONTINUE;
+}
+
+// Message handlers indexed by EXPECT_*
+int (*state_handlers[])(struct client_state* cs, char* cmd, int cmd_len) = {
+	[EXPECT_USERNAME] = handle_username,
+	[EXPECT_KEY_ID] = handle_key_id,
+	[EXPECT_CONFIRMATION] = handle_confirmation,
+	[EXPECT_CLIENT_OK] = handle_client_ok,
+	[EXPECT_CLIENT_MSG] = handle_client_message,
+	[EXPECT_FULL_POWER] = handle_full_power,
+};
+
+// RECHARGING may come in place of a message shorter than itself. Such a
+// message is let run up to RECHARGING_LEN only while what arrived of it,
+// \cur_size bytes buffered and \bytes at \pbuf, can still be RECHARGING
+// return value:
+//     length at which message of \cs is cut, \max is that of its state
+int recharging_maxlen(struct client_state* cs, int max, char* pbuf, int bytes) {
+	int n;
+	int m;
+
+	if (max >= RECHARGING_LEN) {
+		return max;
+	}
+	// "\a\b" is found by framing
+	n = cs->cur_size < RECHARGING_LEN - 2 ? cs->cur_size : RECHARGING_LEN - 2;
+	m = bytes < RECHARGING_LEN - 2 - n ? bytes : RECHARGING_LEN - 2 - n;
+	if (memcmp(cs->buf->client_msg, CLIENT_RECHARGING_MSG, n) != 0 ||
+	    memcmp(pbuf, CLIENT_RECHARGING_MSG + n, m) != 0) {
+		return max;
+	}
+	return RECHARGING_LEN;
+}
+
+/*
+ * Protocol engine. handle_client_data() takes bytes as they arrive from a
+ * robot, in chunks of any size, and queues replies to buf->outq. It does
+ * no I/O of its own and does not close the session, it tells the driver
+ * to: the socket loops of both engines, replay (-R), the navigation
+ * benchmark (-N) and virtual robots (-V) are all drivers. The only call
+ * back into the driver is flush_replies() when the output queue fills up.
+ * If replies can not be sent at once, input is held back and the driver
+ * calls resume_client_data() when they are, so both engines answer a
+ * pipelining robot the same way
+ */
+#define SESSION_OPEN -1
+
+// Keep \bytes of input at \pbuf of \cs for resume_client_data(). \pbuf
+// may lie in the backlog itself
+// return value:
+//     SESSION_OPEN, END_CLOSED if robot sent more than CLIENT_BACKLOG_MAX
+//     without reading replies
+int backlog_append(struct client_state* cs, char* pbuf, int bytes) {
+	struct client_buf* b = cs->buf;
+
+	if (b->backlog_len + bytes > CLIENT_BACKLOG_MAX) {
+		return END_CLOSED;
+	}
+	if (b->backlog == NULL) {
+		b->backlog = malloc(CLIENT_BACKLOG_MAX);
+		if (b->backlog == NULL) {
+			return END_CLOSED;
+		}
+	}
+	memmove(b->backlog + b->backlog_len, pbuf, bytes);
+	b->backlog_len += bytes;
+	return SESSION_OPEN;
+}
+
+// Parse and answer messages in \bytes of input at \pbuf until the output
+// queue of \cs has no room for replies to another message. The rest of
+// input is kept in the backlog
+// return value:
+//     same as handle_client_data()
+int process_client_data(struct client_state* cs, char* pbuf, int bytes)
+{
+	char* cmd;
+	int cmd_len;
+	int state;
+	int step;
+	int max;
+	int len;
+	int room;
+
+	while (1) {
+		if (bytes > 0 && OUTQ_LEN - cs->outq_len < OUTQ_MSG_REPLIES) {
+			room = outq_room(cs);
+			if (room == -1) {
+				step = STEP_CLOSE;
+				break;
+			}
+			if (room < OUTQ_MSG_REPLIES) {
+				// Robot pipelines faster than replies are sent: go on
+				// once they are, as a robot that waits for each reply
+				// would
+				return backlog_append(cs, pbuf, bytes);
+			}
+		}
+		// Messages longer than the one expected in the current state are
+		// rejected as soon as max bytes arrive without terminator
+		max = clientmsg_maxlen(cs->state);
+		if (max == -1) {
+			log_text(LOG_ERROR, cs->fd, "session in unknown state %d", cs->state);
+			step = STEP_INTERNAL_ERROR;
+			break;
+		}
+		max = recharging_maxlen(cs, max, pbuf, bytes);
+		if (cs->cur_size == 0) {
+			// Message starts in pbuf: parse it in place
+			len = SPAN(cs, SPAN_FRAME, has_terminator(pbuf, bytes < max ? bytes : max));
+			if (len == -1) {
+				if (bytes >= max) {
+					step = STEP_SYNTAX_ERROR;
+					break;
+				}
+				// Wait for command completion
+				memcpy(cs->buf->client_msg, pbuf, bytes);
+				cs->cur_size = bytes;
+				return SESSION_OPEN;
+			}
+			cmd = pbuf;
+			cmd_len = len + 2;
+		} else {
+			// Message started in previous read, its tail is in pbuf
+			if (cs->buf->client_msg[cs->cur_size - 1] == '\a' &&
+			    bytes > 0 && pbuf[0] == '\b') {
+				// Terminator is split between reads
+				len = -1;
+			} else {
+				len = SPAN(cs, SPAN_FRAME, has_terminator(pbuf, bytes < max - cs->cur_size ?
+									bytes : max - cs->cur_size));
+				if (len == -1) {
+					if (cs->cur_size + bytes >= max) {
+						step = STEP_SYNTAX_ERROR;
+						break;
+					}
+					memcpy(cs->buf->client_msg + cs->cur_size, pbuf, bytes);
+					cs->cur_size += bytes;
+					return SESSION_OPEN;
+				}
+			}
+			memcpy(cs->buf->client_msg + cs->cur_size, pbuf, len + 2);
+			cmd = cs->buf->client_msg;
+			cmd_len = cs->cur_size + len + 2;
+		}
+		pbuf += cmd_len - cs->cur_size;
+		bytes -= cmd_len - cs->cur_size;
+		// Robot is alive, it has another CLIENT_TIMEOUT_MS for the next message
+		timer_arm(&session_timers, cs);
+		// but not forever. Deadline was just set from the clock
+		if (cmd_len > cs->buf->budget_bytes ||
+		    cs->deadline - CLIENT_TIMEOUT_MS > cs->buf->budget_deadline) {
+			step = STEP_NO_PROGRESS;
+			break;
+		}
+		cs->buf->budget_bytes -= cmd_len;
+
+		print_client_msg(cs, cmd, cmd_len);
+
+		cs->cur_size = 0;
+		state = cs->state;
+		if (cmd_len == RECHARGING_LEN && state != EXPECT_FULL_POWER &&
+		    memcmp(cmd, CLIENT_RECHARGING_MSG, RECHARGING_LEN) == 0) {
+			step = park_session(cs);
+		} else {
+			step = state_handlers[state](cs, cmd, cmd_len);
+		}
+		if (cs->state != state) {
+			metrics_state_end(cs, state);
+			// Recharging is part of the state it interrupts
+			if (state != EXPECT_FULL_POWER && cs->state != EXPECT_FULL_POWER) {
+				budget_start(cs, cs->state);
+			}
+		}
+		if (step != STEP_CONTINUE) {
+			break;
+		}
+	}
+	// The only way out of a session: final reply, if any, and close
+	if (step_replies[step] != NULL) {
+		queue_reply(cs, step_replies[step]);
+	}
+	return step_ends[step];
+}
+
+// Process \bytes of input received from robot \cs
+// return value:
+//     SESSION_OPEN if more input is expected, otherwise END_* reason the
+//     driver has to close the session for by close_client(). The final
+//     reply, if any, is queued
+int handle_client_data(struct client_state* cs, char* pbuf, int bytes)
+{
+	METRIC_ADD(metrics->bytes_in, bytes);
+	if (trace != NULL) {
+		trace_write(cs, TRACE_IN, pbuf, bytes);
+	}
+	if (cs->buf->backlog_len != 0) {
+		// Earlier input still waits for its replies to be sent
+		return backlog_append(cs, pbuf, bytes);
+	}
+	return process_client_data(cs, pbuf, bytes);
+}
+
+// Go on with input held back by handle_client_data(), called by the
+// driver when replies of \cs were sent
+// return value:
+//     same as handle_client_data()
+int resume_client_data(struct client_state* cs) {
+	int bytes = cs->buf->backlog_len;
+
+	if (bytes == 0) {
+		return SESSION_OPEN;
+	}
+	cs->buf->backlog_len = 0;
+	return process_client_data(cs, cs->buf->backlog, bytes);
+}
+
+// Socket is registered edge-triggered: read until EAGAIN, otherwise no
+// further event would be reported for data which is already queued.
+// Replies to everything read are sent at once when input is drained
+void handle_client_msg(struct client_state* cs, uint32_t events)
+{
+	char buf[1024];
+	int bytes;
+	int end;
+
+	if (events & EPOLLOUT) {
+		// Socket buffer has room again for the rest of replies and
+		// for replies to input held back
+		if (flush_replies(cs) != 0) {
+			close_client(cs, END_CLOSED);
+			return;
+		}
+		end = resume_client_data(cs);
+		if (end != SESSION_OPEN) {
+			close_client(cs, end);
+			return;
+		}
+	}
+	if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+		if (flush_replies(cs) != 0) {
+			close_client(cs, END_CLOSED);
+		}
+		return;
+	}
+	while (1) {
+		bytes = SPAN(cs, SPAN_READ, read(cs->fd, buf, sizeof(buf)));
+		if (bytes == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (flush_replies(cs) != 0) {
+					close_client(cs, END_CLOSED);
 				}
-				close(fd);
-				FD_CLR(fd, fds);
+				return;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			// Connection reset or broken otherwise: it is this robot's
+			// problem only
+			METRIC_ADD(metrics->read_errors, 1);
+			close_client(cs, END_CLOSED);
+			return;
+		}
+		if (bytes == 0) {
+			// Robot closed connection
+			close_client(cs, END_CLOSED);
+			return;
+		}
+		end = handle_client_data(cs, buf, bytes);
+		if (end != SESSION_OPEN) {
+			close_client(cs, end);
+			return;
+		}
+	}
+}
+
+// Raise soft limit of open files to the hard one to be able to serve
+// thousands of robots at once
+void raise_nofile_limit(void) {
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+		return;
+	}
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+#define MAX_EVENTS 256
+#define SERVER_PORT 5555
+
+struct handoff_msg;
+
+struct worker {
+	int id;
+	int socket_fd; // TCP listener, -1 if there is none (-p 0)
+	int unix_fd; // dup of the shared unix listener, -1 without -u
+	int epoll_fd;
+	int wake_fd; // eventfd written when successor takes over, -1 without -H
+	int cpu; // worker is pinned to, -1 if not (-P)
+	pthread_t thread;
+	// sessions handed off by the predecessor, to be continued
+	struct handoff_msg* adopt;
+	int nadopt;
+};
+
+#define ENGINE_EPOLL 0
+#define ENGINE_URING 1
+
+int io_engine = ENGINE_EPOLL;
+
+#define LISTEN_BACKLOG 4096
+
+// Admission limit: sessions a worker serves at once, 0 - no limit
+int worker_max_sessions;
+
+// Descriptor of the worker kept for the moment it runs out of them
+__thread int reserve_fd = -1;
+
+// Accept on listener \socket_fd failed with \err. Nothing but the
+// connection being accepted is affected, the worker goes on
+void accept_failed(int socket_fd, int err) {
+	int fd;
+
+	if (err != EMFILE && err != ENFILE) {
+		METRIC_ADD(metrics->accept_errors, 1);
+		log_text(LOG_WARN, -1, "accept failed: %s", strerror(err));
+		return;
+	}
+	// Out of descriptors. The connection would stay at the head of the
+	// accept queue and the listener would be ready again at once, so the
+	// reserve descriptor is given up to accept it and turn it away
+	METRIC_ADD(metrics->fd_exhausted, 1);
+	if (reserve_fd != -1) {
+		close(reserve_fd);
+		fd = accept4(socket_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd != -1) {
+			reject_connect(fd);
+		}
+	}
+	reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/*
+ * Busy polling (-P). Every worker owns a CPU: it is pinned to it and never
+ * sleeps, event loop polls for events without waiting. The kernel is asked
+ * to busy poll device queues of sockets instead of waiting for interrupts
+ * and to steer new connections to the listener of the worker on the CPU
+ * which received them, so a robot is served by a single CPU end to end.
+ * Interrupts of the NIC queues have to be bound to the same CPUs
+ * (/proc/irq/<n>/smp_affinity) for that
+ */
+#define BUSY_POLL_US 50 // of SO_BUSY_POLL
+
+int busy_poll;
+
+// Parse list of CPUs like "2-5,8" to \cpus
+// return value:
+//     number of CPUs, -1 if list is malformed or longer than \max
+int parse_cpus(char* list, int* cpus, int max) {
+	char* p = list;
+	int n = 0;
+	int lo;
+	int hi;
+
+	while (*p != '\0') {
+		if (!isdigit((unsigned char)*p)) {
+			return -1;
+		}
+		lo = hi = strtol(p, &p, 10);
+		if (*p == '-') {
+			p++;
+			if (!isdigit((unsigned char)*p)) {
+				return -1;
+			}
+			hi = strtol(p, &p, 10);
+		}
+		if (*p == ',') {
+			p++;
+		} else if (*p != '\0') {
+			return -1;
+		}
+		for (; lo <= hi; lo++) {
+			if (n == max || lo >= CPU_SETSIZE) {
+				return -1;
+			}
+			cpus[n++] = lo;
+		}
+	}
+	return n;
+}
+
+// Pin the calling thread of worker \w to its CPU
+void pin_worker(struct worker* w) {
+	cpu_set_t set;
+	int rc;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (rc != 0) {
+		log_text(LOG_WARN, -1, "worker %d can not be pinned to CPU %d: %s",
+			 w->id, w->cpu, strerror(rc));
+	}
+}
+
+// Set up listener \fd of worker on \cpu for busy polling. Accepted
+// sockets inherit the options. These are hints: worker works without
+// them, though it waits for interrupts then
+void busy_poll_listener(int fd, int cpu) {
+	int us = BUSY_POLL_US;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1) {
+		log_text(LOG_WARN, -1, "SO_INCOMING_CPU failed: %s", strerror(errno));
+	}
+	// Above net.core.busy_read it needs CAP_NET_ADMIN
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) == -1) {
+		log_text(LOG_WARN, -1, "SO_BUSY_POLL failed: %s", strerror(errno));
+	}
+#ifdef SO_PREFER_BUSY_POLL
+	// Busy polling also keeps device interrupts masked while it goes on
+	setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &(int){ 1 }, sizeof(int));
+#endif
+}
+
+/*
+ * Hot restart. A server started with -H <path> waits for its successor on
+ * that unix socket. The successor, started with -U <path>, connects and
+ * gets the listening sockets of all workers, then every session: its
+ * socket (SCM_RIGHTS) and its state. Robots notice nothing, what they
+ * send meanwhile waits in socket buffers. The old process exits once all
+ * its workers are done. An io_uring worker can not take its sessions back
+ * from the kernel: it stops accepting and finishes them instead
+ */
+#define HANDOFF_VERSION 4
+#define HANDOFF_HELLO 1 // nworkers, listening sockets: TCP of all workers, then unix
+#define HANDOFF_SESSION 2 // session of worker, its socket
+#define HANDOFF_DONE 3 // worker has no more sessions to hand off
+#define HANDOFF_MAX_FDS 253 // SCM_MAX_FD
+#define HANDOFF_OUT_MAX 256 // replies queued but not sent
+// The whole output queue has to fit: no reply is longer than the error
+// below, nor than key_reply
+_Static_assert(OUTQ_LEN * (sizeof(SERVER_KEY_OUT_OF_RANGE_ERROR) - 1) <= HANDOFF_OUT_MAX &&
+	       OUTQ_LEN * sizeof(((struct client_buf*)0)->key_reply) <= HANDOFF_OUT_MAX,
+	       "output queue does not fit handoff message");
+
+// handoff_msg.listeners
+#define HANDOFF_LISTEN_TCP 1
+#define HANDOFF_LISTEN_UNIX 2
+
+struct handoff_msg {
+	int type; // HANDOFF_*
+	int version;
+	int worker;
+	int nworkers;
+	int listeners; // HANDOFF_LISTEN_* sent with HANDOFF_HELLO
+	// HANDOFF_SESSION only
+	int fd; // set by receiver
+	int timeout; // ms left until deadline
+	int x;
+	int y;
+	unsigned char state;
+	unsigned char direction;
+	unsigned char cur_size;
+	unsigned char namelen;
+	unsigned char did_turn;
+	unsigned char was_move;
+	unsigned char blocked;
+	unsigned char nobstacles;
+	unsigned char obstacle_next;
+	unsigned char parked_state;
+	unsigned short client_key;
+	unsigned short commands;
+	unsigned short outlen;
+	unsigned short backlog_len;
+	char name[USERNAME_MAXLEN];
+	char client_msg[CLIENTMSG_MAXLEN];
+	int obstacles[PLAN_MAX_OBSTACLES][2];
+	char out[HANDOFF_OUT_MAX];
+	char backlog[CLIENT_BACKLOG_MAX]; // input not processed yet
+};
+
+char* handoff_path; // -H
+int handoff_listen_fd;
+int handoff_nworkers;
+_Atomic int handoff_sock = -1; // connection to successor
+pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Send \msg with \nfds sockets \fds. Workers share the connection
+// return 0 on success
+//        -1 on error
+int handoff_send(int sock, struct handoff_msg* msg, int* fds, int nfds) {
+	char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+	struct iovec iov = { msg, sizeof(*msg) };
+	struct cmsghdr* cmsg;
+	struct msghdr mh;
+	ssize_t rc;
+
+	msg->version = HANDOFF_VERSION;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (nfds > 0) {
+		memset(control, 0, sizeof(control));
+		mh.msg_control = control;
+		mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+	pthread_mutex_lock(&handoff_lock);
+	do {
+		rc = sendmsg(sock, &mh, MSG_NOSIGNAL);
+	} while (rc == -1 && errno == EINTR);
+	pthread_mutex_unlock(&handoff_lock);
+	return rc == sizeof(*msg) ? 0 : -1;
+}
+
+// Receive \msg and up to \maxfds sockets into \fds
+// return value:
+//     number of sockets received, -1 on error or end of connection
+int handoff_recv(int sock, struct handoff_msg* msg, int* fds, int maxfds) {
+	char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+	struct iovec iov = { msg, sizeof(*msg) };
+	struct cmsghdr* cmsg;
+	struct msghdr mh;
+	ssize_t rc;
+	int n = 0;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+	do {
+		rc = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+	} while (rc == -1 && errno == EINTR);
+	if (rc != sizeof(*msg) || msg->version != HANDOFF_VERSION) {
+		return -1;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if (n > maxfds) {
+				return -1;
+			}
+			memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+		}
+	}
+	return n;
+}
+
+// Hand session \cs of worker \w off to the successor and forget it
+// return 0 on success
+//        -1 if it could not be sent, session stays here
+int handoff_session(struct worker* w, struct client_state* cs, int sock) {
+	struct handoff_msg m;
+	struct client_buf* b = cs->buf;
+	struct iovec* iov;
+	int i;
+
+	memset(&m, 0, sizeof(m));
+	m.type = HANDOFF_SESSION;
+	m.worker = w->id;
+	m.timeout = cs->deadline - now_ms();
+	m.x = cs->x;
+	m.y = cs->y;
+	m.state = cs->state;
+	m.direction = cs->direction;
+	m.cur_size = cs->cur_size;
+	m.namelen = cs->namelen;
+	m.did_turn = cs->did_turn;
+	m.was_move = cs->was_move;
+	m.blocked = cs->blocked;
+	m.nobstacles = cs->nobstacles;
+	m.obstacle_next = b->obstacle_next;
+	m.parked_state = b->parked_state;
+	m.client_key = cs->client_key;
+	m.commands = b->commands;
+	memcpy(m.name, b->name, sizeof(m.name));
+	memcpy(m.client_msg, b->client_msg, cs->cur_size);
+	memcpy(m.obstacles, b->obstacles, sizeof(m.obstacles));
+	for (i = cs->outq_sent; i < cs->outq_len; i++) {
+		iov = &b->outq[i];
+		memcpy(m.out + m.outlen, iov->iov_base, iov->iov_len);
+		m.outlen += iov->iov_len;
+	}
+	if (b->backlog_len != 0) {
+		m.backlog_len = b->backlog_len;
+		memcpy(m.backlog, b->backlog, b->backlog_len);
+	}
+	if (handoff_send(sock, &m, &cs->fd, 1) != 0) {
+		return -1;
+	}
+	if (spans != NULL) {
+		span_close(cs);
+	}
+	// Successor holds the connection now, close() does not end it
+	close(cs->fd);
+	timer_cancel(cs);
+	session_free(cs);
+	METRIC_SET(metrics->active, sessions.nsessions);
+	return 0;
+}
+
+// Hand all sessions of epoll worker \w off and stop accepting
+// return 0 if worker is done
+//        -1 if successor went away, worker goes on with sessions left
+int handoff_worker(struct worker* w) {
+	struct handoff_msg m;
+	struct session_slab* slab;
+	struct client_state* cs;
+	int sock = atomic_load(&handoff_sock);
+	int i;
+
+	epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, w->socket_fd, NULL);
+	epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, w->unix_fd, NULL);
+	for (slab = sessions.slabs; slab != NULL; slab = slab->next) {
+		for (i = 0; i < SESSION_SLAB_SIZE; i++) {
+			cs = &slab->states[i];
+			if (cs->state != 0 && handoff_session(w, cs, sock) != 0) {
+				goto failed;
+			}
+		}
+	}
+	memset(&m, 0, sizeof(m));
+	m.type = HANDOFF_DONE;
+	m.worker = w->id;
+	if (handoff_send(sock, &m, NULL, 0) != 0) {
+		goto failed;
+	}
+	close(w->socket_fd);
+	close(w->unix_fd);
+	return 0;
+failed:
+	log_text(LOG_ERROR, -1, "handoff of worker %d failed: %s", w->id, strerror(errno));
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->socket_fd, &ev);
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.ptr = &w->unix_fd;
+	epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->unix_fd, &ev);
+	return -1;
+}
+
+// io_uring worker \w stopped accepting, it finishes its sessions itself
+void handoff_drain(struct worker* w) {
+	struct handoff_msg m;
+
+	memset(&m, 0, sizeof(m));
+	m.type = HANDOFF_DONE;
+	m.worker = w->id;
+	if (handoff_send(atomic_load(&handoff_sock), &m, NULL, 0) != 0) {
+		log_text(LOG_ERROR, -1, "handoff of worker %d failed: %s", w->id, strerror(errno));
+	}
+	close(w->socket_fd);
+	close(w->unix_fd);
+}
+
+// Continue session \m handed off by the predecessor
+void handoff_adopt(struct worker* w, struct handoff_msg* m) {
+	struct client_state* cs;
+	struct epoll_event ev;
+	int end;
+
+	cs = session_alloc();
+	if (cs == NULL) {
+		close(m->fd);
+		return;
+	}
+	cs->fd = m->fd;
+	cs->x = m->x;
+	cs->y = m->y;
+	cs->state = m->state;
+	cs->direction = m->direction;
+	cs->cur_size = m->cur_size;
+	cs->namelen = m->namelen;
+	cs->did_turn = m->did_turn;
+	cs->was_move = m->was_move;
+	cs->blocked = m->blocked;
+	cs->nobstacles = m->nobstacles;
+	cs->client_key = m->client_key;
+	cs->buf->obstacle_next = m->obstacle_next;
+	cs->buf->parked_state = m->parked_state;
+	cs->buf->commands = m->commands;
+	cs->buf->state_since = now_us();
+	// Budget of the state starts over
+	budget_start(cs, cs->state == EXPECT_FULL_POWER ? m->parked_state : cs->state);
+	memcpy(cs->buf->name, m->name, sizeof(m->name));
+	memcpy(cs->buf->client_msg, m->client_msg, m->cur_size);
+	memcpy(cs->buf->obstacles, m->obstacles, sizeof(m->obstacles));
+	if (max_per_peer != 0) {
+		struct sockaddr_in addr;
+		socklen_t size = sizeof(addr);
+
+		// Robots already served are kept, even over the limit
+		if (getpeername(cs->fd, (struct sockaddr *)&addr, &size) == 0) {
+			peer_acquire(cs, addr.sin_addr.s_addr);
+		}
+	}
+	METRIC_SET(metrics->active, sessions.nsessions);
+	trace_open(cs);
+	span_open(cs);
+	// Adopted sessions are armed in order of their deadlines before any
+	// new one, so timer queues stay sorted
+	timer_arm(cs->state == EXPECT_FULL_POWER ? &recharging_timers : &session_timers, cs);
+	cs->deadline = now_ms() + (m->timeout > 0 ? m->timeout : 0);
+
+	// Replies the predecessor had no chance to send. They are a few
+	// bytes, a robot whose socket buffer can not take them is stuck
+	if (m->outlen != 0 &&
+	    send(cs->fd, m->out, m->outlen, MSG_NOSIGNAL | MSG_DONTWAIT) != m->outlen) {
+		close_client(cs, END_CLOSED);
+		return;
+	}
+	// Input held back for those replies is answered first
+	if (m->backlog_len != 0 &&
+	    backlog_append(cs, m->backlog, m->backlog_len) != SESSION_OPEN) {
+		close_client(cs, END_CLOSED);
+		return;
+	}
+	if (uring != NULL) {
+		uring_recv(uring, cs);
+		end = resume_client_data(cs);
+		if (end != SESSION_OPEN) {
+			close_client(cs, end);
+			return;
+		}
+		uring_send(uring, cs);
+		return;
+	}
+	// Input which arrived during handoff and the backlog are reported
+	// at once
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = cs;
+	if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, cs->fd, &ev) == -1) {
+		perror("epoll_ctl failed");
+		close_client(cs, END_CLOSED);
+	}
+}
+
+int handoff_cmp_timeout(const void* a, const void* b) {
+	return ((struct handoff_msg*)a)->timeout - ((struct handoff_msg*)b)->timeout;
+}
+
+// Continue all sessions handed off to worker \w
+void handoff_adopt_all(struct worker* w) {
+	int i;
+
+	if (w->nadopt == 0) {
+		return;
+	}
+	qsort(w->adopt, w->nadopt, sizeof(w->adopt[0]), handoff_cmp_timeout);
+	for (i = 0; i < w->nadopt; i++) {
+		handoff_adopt(w, &w->adopt[i]);
+	}
+	free(w->adopt);
+	w->adopt = NULL;
+	w->nadopt = 0;
+}
+
+// Wait for successor on the unix socket handoff_path, give it listening
+// sockets and wake up workers to hand their sessions off
+void* handoff_server(void* arg) {
+	struct worker* workers = arg;
+	struct handoff_msg m;
+	int fds[HANDOFF_MAX_FDS];
+	int nworkers = handoff_nworkers;
+	int nfds = 0;
+	int sock;
+	int i;
+
+	do {
+		sock = accept4(handoff_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	} while (sock == -1);
+	close(handoff_listen_fd);
+	unlink(handoff_path);
+	log_text(LOG_INFO, -1, "successor connected, handing off");
+
+	memset(&m, 0, sizeof(m));
+	m.type = HANDOFF_HELLO;
+	m.nworkers = nworkers;
+	if (workers[0].socket_fd != -1) {
+		m.listeners |= HANDOFF_LISTEN_TCP;
+		for (i = 0; i < nworkers; i++) {
+			fds[nfds++] = workers[i].socket_fd;
+		}
+	}
+	if (workers[0].unix_fd != -1) {
+		// Workers have dups of the same socket
+		m.listeners |= HANDOFF_LISTEN_UNIX;
+		fds[nfds++] = workers[0].unix_fd;
+	}
+	if (handoff_send(sock, &m, fds, nfds) != 0) {
+		log_text(LOG_ERROR, -1, "handoff failed: %s", strerror(errno));
+		close(sock);
+		return NULL;
+	}
+	atomic_store(&handoff_sock, sock);
+	for (i = 0; i < nworkers; i++) {
+		eventfd_write(workers[i].wake_fd, 1);
+	}
+	return NULL;
+}
+
+// Wait for successor on unix socket \path, see handoff_server()
+void handoff_listen(char* path, struct worker* workers, int nworkers) {
+	struct sockaddr_un addr;
+	pthread_t thread;
+	int rc;
+	int i;
+
+	if (nworkers > HANDOFF_MAX_FDS - 1) {
+		fprintf(stderr, "hot restart supports up to %d workers\n", HANDOFF_MAX_FDS - 1);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < nworkers; i++) {
+		workers[i].wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (workers[i].wake_fd == -1) {
+			perror("eventfd failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+	handoff_nworkers = nworkers;
+	handoff_path = path;
+	handoff_listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (handoff_listen_fd == -1) {
+		perror("socket failed");
+		exit(EXIT_FAILURE);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "handoff socket path is too long: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(handoff_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    listen(handoff_listen_fd, 1) == -1) {
+		perror("handoff socket failed");
+		exit(EXIT_FAILURE);
+	}
+	rc = pthread_create(&thread, NULL, handoff_server, workers);
+	if (rc != 0) {
+		fprintf(stderr, "pthread_create failed: %s\n", strerror(rc));
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Connect to the running server waiting on unix socket \path and get
+// TCP listening sockets of its workers to \listeners (-1 if it has none)
+// and its unix listener to \unix_fd (-1 if none)
+// return value:
+//     connection to predecessor, number of its workers in \nworkers
+int handoff_connect(char* path, int* nworkers, int* listeners, int* unix_fd) {
+	struct sockaddr_un addr;
+	struct handoff_msg m;
+	int sock;
+	int i;
+	int n;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock == -1) {
+		perror("socket failed");
+		exit(EXIT_FAILURE);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "handoff socket path is too long: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, path);
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	n = handoff_recv(sock, &m, listeners, HANDOFF_MAX_FDS);
+	if (m.type != HANDOFF_HELLO || m.nworkers < 1 || m.listeners == 0 ||
+	    n != (m.listeners & HANDOFF_LISTEN_TCP ? m.nworkers : 0) +
+		 (m.listeners & HANDOFF_LISTEN_UNIX ? 1 : 0)) {
+		fprintf(stderr, "%s: handoff failed\n", path);
+		exit(EXIT_FAILURE);
+	}
+	*unix_fd = m.listeners & HANDOFF_LISTEN_UNIX ? listeners[n - 1] : -1;
+	if (!(m.listeners & HANDOFF_LISTEN_TCP)) {
+		for (i = 0; i < m.nworkers; i++) {
+			listeners[i] = -1;
+		}
+	}
+	*nworkers = m.nworkers;
+	return sock;
+}
+
+// Receive sessions of all predecessor workers, each one goes to the
+// worker of the same number
+void handoff_receive(int sock, struct worker* workers, int nworkers) {
+	struct handoff_msg m;
+	struct worker* w;
+	int* cap;
+	int done = 0;
+	int fd;
+	int n;
+
+	cap = calloc(nworkers, sizeof(cap[0]));
+	if (cap == NULL) {
+		perror("calloc failed");
+		exit(EXIT_FAILURE);
+	}
+	while (done < nworkers) {
+		n = handoff_recv(sock, &m, &fd, 1);
+		if (n == -1 || m.worker < 0 || m.worker >= nworkers ||
+		    (m.type == HANDOFF_SESSION) != (n == 1)) {
+			fprintf(stderr, "handoff failed: predecessor went away\n");
+			exit(EXIT_FAILURE);
+		}
+		if (m.type == HANDOFF_DONE) {
+			done++;
+			continue;
+		}
+		w = &workers[m.worker];
+		if (w->nadopt == cap[m.worker]) {
+			cap[m.worker] = cap[m.worker] ? cap[m.worker] * 2 : 64;
+			w->adopt = realloc(w->adopt, cap[m.worker] * sizeof(w->adopt[0]));
+			if (w->adopt == NULL) {
+				perror("realloc failed");
+				exit(EXIT_FAILURE);
+			}
+		}
+		m.fd = fd;
+		w->adopt[w->nadopt++] = m;
+	}
+	free(cap);
+	close(sock);
+}
+
+// Handle completion \cqe of the io_uring event loop
+// return value:
+//     0 on success
+//     -1 if kernel does not support multishot accept
+int uring_complete(struct uring* u, struct worker* w, struct io_uring_cqe* cqe)
+{
+	struct client_state* cs;
+	struct client_buf* b;
+	int op;
+	int bid = -1;
+	int end;
+
+	op = cqe->user_data & URING_OP_MASK;
+	cs = (struct client_state*)(unsigned long)(cqe->user_data & ~(unsigned long long)URING_OP_MASK);
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	}
+
+	if (op == URING_OP_ACCEPT || op == URING_OP_ACCEPT_UNIX) {
+		int listener = op == URING_OP_ACCEPT ? w->socket_fd : w->unix_fd;
+
+		if (cqe->res == -EINVAL) {
+			if (u->accept_single & 1 << op) {
+				// Not even a single accept is taken: re-arming
+				// would only spin
+				log_text(LOG_ERROR, -1, "accept failed: %s, listener is given up",
+					 strerror(EINVAL));
 				return 0;
 			}
-			// Check confirmation code: restore hash value
-			code += 65536;
-			code -= authentification_keys[client_states[fd].keyid].client_key;
-			code %= 65536;
-		
-			if (code != get_hash(client_states[fd].name, client_states[fd].namelen)) {
-				// confirmation code is wrong
-				tmp = SERVER_LOGIN_FAILED;
-				rc = write(fd, tmp, strlen(tmp));
-				if (rc != strlen(tmp)) {
-					close(fd);
-					FD_CLR(fd, fds);
-					return 0;
+			if (sessions.capacity == 0) {
+				// Multishot accept is not supported (before 5.19),
+				// worker falls back to epoll
+				return -1;
+			}
+			// Adopted sessions live in this ring already, so it stays:
+			// connections are accepted one at a time
+			log_text(LOG_WARN, -1, "multishot accept is not supported, "
+				 "accepting one connection at a time");
+			u->accept_single |= 1 << op;
+		} else if (cqe->res < 0 && cqe->res != -ECONNABORTED && cqe->res != -ECANCELED) {
+			accept_failed(listener, -cqe->res);
+		}
+		if (cqe->res >= 0 && worker_max_sessions != 0 &&
+		    sessions.nsessions >= worker_max_sessions) {
+			METRIC_ADD(metrics->rejects, 1);
+			reject_connect(cqe->res);
+		} else if (cqe->res >= 0) {
+			struct sockaddr_in clientaddr = { 0 };
+			socklen_t size = sizeof(clientaddr);
+
+			// Multishot accept does not return the address. Gateways on
+			// the unix socket have none and no limit
+			if (op == URING_OP_ACCEPT &&
+			    (LOG_ENABLED(LOG_INFO) || max_per_peer != 0)) {
+				getpeername(cqe->res, (struct sockaddr *)&clientaddr, &size);
+			}
+			cs = session_alloc();
+			if (cs == NULL) {
+				close(cqe->res);
+			} else if (max_per_peer != 0 && op == URING_OP_ACCEPT &&
+				   peer_acquire(cs, clientaddr.sin_addr.s_addr) != 0) {
+				METRIC_ADD(metrics->peer_rejects, 1);
+				session_free(cs);
+				reject_connect(cqe->res);
+			} else {
+				cs->fd = cqe->res;
+				if (LOG_ENABLED(LOG_INFO)) {
+					log_event(LOG_INFO, LOG_EV_CONNECT, cs->fd, &clientaddr.sin_addr,
+						  op == URING_OP_ACCEPT ? sizeof(clientaddr.sin_addr) : 0);
 				}
-				// Close connection
-				close(fd);
-				FD_CLR(fd, fds);
-				return 0;
+				// Newly connected robot is to sent CLIENT_USERNAME
+				cs->state = EXPECT_USERNAME;
+				budget_start(cs, EXPECT_USERNAME);
+				metrics_session_start(cs);
+				trace_open(cs);
+				span_open(cs);
+				timer_arm(&session_timers, cs);
+				uring_recv(u, cs);
 			}
-			tmp = SERVER_OK;
-			rc = write(fd, tmp, strlen(tmp));
-			if (rc != strlen(tmp)) {
-				close(fd);
-				FD_CLR(fd, fds);
-				return 0;
+		}
+		if (!(cqe->flags & IORING_CQE_F_MORE) && !u->draining) {
+			uring_accept(u, listener, op);
+		}
+		return 0;
+	}
+	if (op == URING_OP_WAKE) {
+		// Successor takes over. Sessions can not be taken back from
+		// the kernel, so they are finished here while the successor
+		// accepts new ones
+		u->draining = 1;
+		if (w->socket_fd != -1) {
+			uring_cancel_accept(u, URING_OP_ACCEPT);
+		}
+		if (w->unix_fd != -1) {
+			uring_cancel_accept(u, URING_OP_ACCEPT_UNIX);
+		}
+		handoff_drain(w);
+		return 0;
+	}
+	if (op == URING_OP_CANCEL) {
+		return 0;
+	}
+
+	b = cs->buf;
+	switch (op) {
+	case URING_OP_RECV:
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			b->inflight--;
+		}
+		if (b->closing) {
+			break;
+		}
+		if (cqe->res > 0) {
+			end = handle_client_data(cs, u->bufs + bid * URING_BUFSIZE, cqe->res);
+			if (end != SESSION_OPEN) {
+				close_client(cs, end);
+				break;
 			}
-			// Initialize unknown position and orientation
-			client_states[fd].x = X_UNKNOWN;
-			client_states[fd].y = Y_UNKNOWN;
-			client_states[fd].direction = DIRECTION_UNKNOWN;
-		
-			// Send first of moves to detect current location
-			rc = write(fd, SERVER_MOVE, strlen(SERVER_MOVE));
-			if (rc != strlen(SERVER_MOVE)) {
-				close(fd);
-				FD_CLR(fd, fds);
-				return 0;
+			uring_send(u, cs);
+		} else if (cqe->res == 0) {
+			// Robot closed connection
+			close_client(cs, END_CLOSED);
+			break;
+		} else if (cqe->res == -EINVAL && u->multishot_recv) {
+			// Multishot recv is not supported (before 6.0)
+			u->multishot_recv = 0;
+		} else if (cqe->res != -ENOBUFS) {
+			METRIC_ADD(metrics->read_errors, 1);
+			close_client(cs, END_CLOSED);
+			break;
+		}
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			uring_recv(u, cs);
+		}
+		break;
+	case URING_OP_SEND:
+		b->inflight--;
+		b->sending = 0;
+		if (cqe->res < 0) {
+			if (!b->closing) {
+				close_client(cs, END_CLOSED);
+			}
+			break;
+		}
+		METRIC_ADD(metrics->bytes_out, cqe->res);
+		// Drop sent replies, trim partially sent one
+		while (cqe->res > 0) {
+			if ((size_t)cqe->res >= b->outq[cs->outq_sent].iov_len) {
+				cqe->res -= b->outq[cs->outq_sent].iov_len;
+				cs->outq_sent++;
+				continue;
+			}
+			b->outq[cs->outq_sent].iov_base = (char*)b->outq[cs->outq_sent].iov_base + cqe->res;
+			b->outq[cs->outq_sent].iov_len -= cqe->res;
+			cqe->res = 0;
+		}
+		if (cs->outq_sent == cs->outq_len) {
+			cs->outq_len = 0;
+			cs->outq_sent = 0;
+		}
+		if (b->closing == URING_CLOSE_REQUESTED) {
+			// shutdown waited for this send
+			uring_close(u, cs);
+		} else if (!b->closing) {
+			end = resume_client_data(cs);
+			if (end != SESSION_OPEN) {
+				close_client(cs, end);
+				break;
+			}
+			uring_send(u, cs);
+		}
+		break;
+	case URING_OP_SHUTDOWN:
+		b->inflight--;
+		break;
+	}
+	if (b->closing && b->inflight == 0) {
+		close(cs->fd);
+		session_free(cs);
+	}
+	if (bid != -1) {
+		uring_recycle(u, bid);
+	}
+	return 0;
+}
+
+// io_uring event loop of a worker
+// return value:
+//     0 when worker finished its sessions for the successor
+//     -1 if the kernel lacks io_uring support the engine needs, before
+//     any connection is accepted
+int uring_worker_loop(struct worker* w)
+{
+	struct io_uring_cqe* cqe;
+	struct uring* u;
+	long long start;
+	unsigned head;
+	unsigned tail;
+	int timeout;
+
+	u = uring_setup();
+	if (u == NULL) {
+		return -1;
+	}
+	uring = u;
+	if (w->socket_fd != -1) {
+		uring_accept(u, w->socket_fd, URING_OP_ACCEPT);
+	}
+	if (w->unix_fd != -1) {
+		uring_accept(u, w->unix_fd, URING_OP_ACCEPT_UNIX);
+	}
+	if (w->wake_fd != -1) {
+		uring_poll_wake(u, w->wake_fd);
+	}
+	handoff_adopt_all(w);
+	while (!u->draining || sessions.nsessions != 0) {
+		/* wait until a completion arrives or the nearest session
+		 * deadline passes */
+		timeout = busy_poll ? 0 : timers_next_timeout(now_ms());
+		trace_sync();
+		spans_sync();
+		qsbr_offline();
+		start = SPAN_START();
+		uring_submit(u, timeout);
+		if (spans != NULL) {
+			span_add(NULL, SPAN_WAIT, start);
+		}
+		qsbr_online();
+		head = *u->cq_head;
+		tail = atomic_load_explicit((_Atomic unsigned *)u->cq_tail, memory_order_acquire);
+		for (; head != tail; head++) {
+			cqe = &u->cqes[head & u->cq_mask];
+			if (uring_complete(u, w, cqe) == -1) {
+				uring = NULL;
+				uring_destroy(u);
+				return -1;
+			}
+		}
+		atomic_store_explicit((_Atomic unsigned *)u->cq_head, head, memory_order_release);
+		timers_expire(now_ms());
+	}
+	trace_sync();
+	spans_sync();
+	uring = NULL;
+	uring_destroy(u);
+	session_store_destroy();
+	return 0;
+}
+
+// Accept pending connections of worker \w, at most ACCEPT_BATCH per
+// wakeup so that robots already connected are not starved during an
+// accept storm. Listener is level-triggered: what is left is reported
+// again. Robots over the admission limit are turned away at once
+#define ACCEPT_BATCH 256
+
+void accept_robots(struct worker* w, int socket_fd)
+{
+	struct client_state* cs;
+	struct epoll_event ev;
+	struct in_addr addr;
+	long long start;
+	int fd;
+	int i;
+
+	for (i = 0; i < ACCEPT_BATCH; i++) {
+		start = SPAN_START();
+		fd = handle_connect(socket_fd, &addr);
+		if (fd == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				accept_failed(socket_fd, errno);
+			}
+			return;
+		}
+		if (worker_max_sessions != 0 && sessions.nsessions >= worker_max_sessions) {
+			METRIC_ADD(metrics->rejects, 1);
+			reject_connect(fd);
+			continue;
+		}
+		// Initialize new client record
+		cs = session_alloc();
+		if (cs == NULL) {
+			close(fd);
+			continue;
+		}
+		// Gateways on the unix socket have no address and no limit
+		if (max_per_peer != 0 && addr.s_addr != INADDR_ANY &&
+		    peer_acquire(cs, addr.s_addr) != 0) {
+			METRIC_ADD(metrics->peer_rejects, 1);
+			session_free(cs);
+			reject_connect(fd);
+			continue;
+		}
+		cs->fd = fd;
+		// Edge-triggered EPOLLOUT is reported only when a full
+		// socket buffer gets room, so it costs nothing otherwise
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = cs;
+		if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			perror("epoll_ctl failed");
+			close(fd);
+			session_free(cs);
+			continue;
+		}
+		// Newly connected robot is to sent CLIENT_USERNAME
+		cs->state = EXPECT_USERNAME;
+		budget_start(cs, EXPECT_USERNAME);
+		metrics_session_start(cs);
+		trace_open(cs);
+		timer_arm(&session_timers, cs);
+		if (spans != NULL) {
+			span_open(cs);
+			span_add(cs, SPAN_ACCEPT, start);
+		}
+	}
+}
+
+// Event loop of a worker. Each worker accepts connections on its own
+// SO_REUSEPORT listener and serves them with its own epoll set and
+// session table
+void* worker_loop(void* arg)
+{
+	struct worker* w = arg;
+	struct epoll_event ev;
+	struct epoll_event events[MAX_EVENTS];
+	int socket_fd;
+	int handoff;
+	int timeout;
+	int rc;
+	int i;
+
+	if (log_rings != NULL) {
+		log_ring = log_rings[w->id];
+	}
+	metrics = worker_metrics[w->id];
+	qsbr_slot = &qsbr_slots[w->id];
+	if (trace_path != NULL) {
+		trace = trace_create(trace_path, w->id);
+		if (trace == NULL) {
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (spans_path != NULL) {
+		spans = spans_create(spans_path, w->id);
+		if (spans == NULL) {
+			exit(EXIT_FAILURE);
+		}
+	}
+	socket_fd = w->socket_fd;
+	if (w->cpu != -1) {
+		pin_worker(w);
+	}
+	reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	if (io_engine == ENGINE_URING) {
+		if (uring_worker_loop(w) == 0) {
+			return NULL;
+		}
+		// Kernel does not support io_uring engine
+		log_text(LOG_WARN, -1, "io_uring is not supported, worker %d falls back to epoll", w->id);
+	}
+
+	w->epoll_fd = epoll_create1(0);
+	if (w->epoll_fd == -1) {
+		perror("epoll_create1 failed");
+		exit(EXIT_FAILURE);
+	}
+	/* initially epoll set contains only connect sockets */
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (socket_fd != -1 && epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, socket_fd, &ev) == -1) {
+		perror("epoll_ctl failed");
+		exit(EXIT_FAILURE);
+	}
+	if (w->unix_fd != -1) {
+		// Listener is shared, a connection wakes up one worker only
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.ptr = &w->unix_fd;
+		if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->unix_fd, &ev) == -1) {
+			perror("epoll_ctl failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (w->wake_fd != -1) {
+		// Successor takes over
+		ev.events = EPOLLIN;
+		ev.data.ptr = w;
+		if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->wake_fd, &ev) == -1) {
+			perror("epoll_ctl failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+	handoff_adopt_all(w);
+	while (1) {
+		/* wait until input arrives on any of registered sockets or the
+		 * nearest session deadline passes */
+		timeout = busy_poll ? 0 : timers_next_timeout(now_ms());
+		trace_sync();
+		spans_sync();
+		qsbr_offline();
+		rc = SPAN(NULL, SPAN_WAIT, epoll_wait(w->epoll_fd, events, MAX_EVENTS, timeout));
+		qsbr_online();
+		if (rc == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait failed");
+			exit(EXIT_FAILURE);
+		}
+		/* only sockets for which input is pending are reported */
+		handoff = 0;
+		for (i = 0; i < rc; i++) {
+			if (events[i].data.ptr == NULL) {
+				/* connect requests */
+				accept_robots(w, socket_fd);
+				continue;
+			}
+			if (events[i].data.ptr == &w->unix_fd) {
+				accept_robots(w, w->unix_fd);
+				continue;
+			}
+			if (events[i].data.ptr == w) {
+				// Handed off after the events, they may refer to sessions
+				handoff = 1;
+				continue;
+			}
+
+			// Process robot message from already connected robot
+			handle_client_msg(events[i].data.ptr, events[i].events);
+		}
+		timers_expire(now_ms());
+		if (handoff && handoff_worker(w) == 0) {
+			trace_sync();
+			spans_sync();
+			close(w->epoll_fd);
+			session_store_destroy();
+			return NULL;
+		}
+	}
+	/* no way to get here */
+	return NULL;
+}
+
+/*
+ * Parser self-check and benchmark (-B). Framing and decode functions are
+ * first checked against plain reference implementations on random inputs
+ * built to hit their edge cases, then timed on realistic and adversarial
+ * inputs
+ */
+#define CHECK_ROUNDS 2000000
+#define BENCH_CALLS 4000000
+#define BENCH_MSG_MAX 128
+
+int ref_has_terminator(char* msg, int length) {
+	int i;
+
+	for (i = 0; i + 1 < length; i++) {
+		if (msg[i] == '\a' && msg[i + 1] == '\b') {
+			return i;
+		}
+	}
+	return -1;
+}
+
+_Bool ref_decode_client_text(int length, int max, int* textlen) {
+	if (length - 2 < 1 || length > max) {
+		return false;
+	}
+	*textlen = length - 2;
+	return true;
+}
+
+// Text of framed \msg of \length bytes as a C string in \text. Robot may
+// send '\0' too, so it is mapped to a char no decoder accepts
+void ref_text(char* msg, int length, char* text) {
+	int i;
+
+	for (i = 0; i < length - 2; i++) {
+		text[i] = msg[i] == '\0' ? '?' : msg[i];
+	}
+	text[i] = '\0';
+}
+
+_Bool ref_decode_client_keyid_confirm(char* msg, int length, int max, int* key_id) {
+	char text[BENCH_MSG_MAX];
+	long long num;
+	int len;
+
+	ref_text(msg, length, text);
+	len = strlen(text);
+	if (len == 0 || (int)strspn(text, "0123456789") != len) {
+		return false;
+	}
+	// leading zeros do not count
+	if (len - (int)strspn(text, "0") > 10) {
+		return false;
+	}
+	num = strtoll(text, NULL, 10);
+	if (num > max) {
+		return false;
+	}
+	*key_id = num;
+	return true;
+}
+
+// "-?[0-9]{1,COORD_MAXDIGITS}" at *pp
+_Bool ref_coord(char** pp, int* val) {
+	char* p = *pp + (**pp == '-');
+	int digits = strspn(p, "0123456789");
+
+	if (digits == 0 || digits > COORD_MAXDIGITS) {
+		return false;
+	}
+	*val = strtol(*pp, NULL, 10);
+	*pp = p + digits;
+	return true;
+}
+
+_Bool ref_decode_client_ok(char* msg, int length, int* x, int* y) {
+	char text[BENCH_MSG_MAX];
+	char* p = text;
+
+	ref_text(msg, length, text);
+	if (strncmp(p, "OK ", 3) != 0) {
+		return false;
+	}
+	p += 3;
+	if (!ref_coord(&p, x) || *p++ != ' ' || !ref_coord(&p, y)) {
+		return false;
+	}
+	return *p == '\0';
+}
+
+int ref_get_hash(char* name, int namelen) {
+	unsigned int sum = 0;
+	int i;
+
+	for (i = 0; i < namelen; i++) {
+		sum += (unsigned char)name[i];
+	}
+	return sum * 1000 % 65536;
+}
+
+__thread unsigned int bench_rng = 1;
+
+unsigned int bench_rand(void) {
+	bench_rng ^= bench_rng << 13;
+	bench_rng ^= bench_rng >> 17;
+	bench_rng ^= bench_rng << 5;
+	return bench_rng;
+}
+
+// Random text of up to \max bytes in \buf, mostly of chars parsers care
+// about, and "\a\b" appended unless \raw
+// return value:
+//     length
+int bench_message(char* buf, int max, _Bool raw) {
+	static const char alphabet[] = "0123456789-OK \a\b";
+	char* valid[] = { "OK ", "-", "12", "0", "999", "65535", "65536", "123456789", "1234567890" };
+	int len = bench_rand() % max;
+	int i = 0;
+
+	while (i < len) {
+		if (bench_rand() % 4 == 0) {
+			// piece of a valid message
+			char* v = valid[bench_rand() % (sizeof(valid) / sizeof(valid[0]))];
+			int n = strlen(v);
+
+			if (i + n > len) {
+				break;
+			}
+			memcpy(buf + i, v, n);
+			i += n;
+		} else if (bench_rand() % 16 == 0) {
+			buf[i++] = bench_rand();
+		} else {
+			buf[i++] = alphabet[bench_rand() % (sizeof(alphabet) - 1)];
+		}
+	}
+	if (raw) {
+		return i;
+	}
+	// Framed message has no terminator but the last one
+	for (len = 0; len + 1 < i; len++) {
+		if (buf[len] == '\a' && buf[len + 1] == '\b') {
+			break;
+		}
+	}
+	if (len + 1 >= i) {
+		len = i;
+	}
+	buf[len] = '\a';
+	buf[len + 1] = '\b';
+	return len + 2;
+}
+
+// return value:
+//     number of inputs on which a function and its reference disagree
+int bench_check(void) {
+	char buf[BENCH_MSG_MAX + 2];
+	int fails = 0;
+	int len;
+	int a;
+	int b;
+	int ax;
+	int ay;
+	int bx;
+	int by;
+	int i;
+
+	for (i = 0; i < CHECK_ROUNDS; i++) {
+		len = bench_message(buf, BENCH_MSG_MAX, true);
+		if (has_terminator(buf, len) != ref_has_terminator(buf, len)) {
+			fprintf(stderr, "has_terminator differs on input %d\n", i);
+			fails++;
+		}
+		len = bench_message(buf, BENCH_MSG_MAX - 2, false);
+		a = b = -1;
+		if (decode_client_text(len, USERNAME_MAXLEN, &a) !=
+		    ref_decode_client_text(len, USERNAME_MAXLEN, &b) || a != b) {
+			fprintf(stderr, "decode_client_text differs on input %d\n", i);
+			fails++;
+		}
+		a = b = -1;
+		if (decode_client_keyid_confirm(buf, 65535, &a) !=
+		    ref_decode_client_keyid_confirm(buf, len, 65535, &b) || a != b) {
+			fprintf(stderr, "decode_client_keyid_confirm differs on input %d\n", i);
+			fails++;
+		}
+		ax = ay = bx = by = -1;
+		if (decode_client_ok(buf, &ax, &ay) != ref_decode_client_ok(buf, len, &bx, &by) ||
+		    ax != bx || ay != by) {
+			fprintf(stderr, "decode_client_ok differs on input %d\n", i);
+			fails++;
+		}
+		if (get_hash(buf, len - 2) != ref_get_hash(buf, len - 2)) {
+			fprintf(stderr, "get_hash differs on input %d\n", i);
+			fails++;
+		}
+	}
+	return fails;
+}
+
+// Session whose state got corrupted has to end for END_INTERNAL_ERROR
+// and touch nothing but its own end counter
+// return value:
+//     0 if it does, 1 otherwise
+int bench_check_state(void) {
+	struct histogram* commands;
+	struct client_state* cs;
+	char msg[] = "OK 1 2\a\b";
+	int level;
+	int end;
+	int ok;
+
+	commands = malloc(sizeof(*commands));
+	cs = session_alloc();
+	if (commands == NULL || cs == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	// state_time[STATE_COUNT] would be the histogram right after it
+	memcpy(commands, &metrics->commands, sizeof(*commands));
+	cs->fd = -1;
+	cs->state = STATE_COUNT;
+	// the error is expected here, a clean self-check prints nothing
+	level = log_level;
+	log_level = LOG_OFF;
+	end = handle_client_data(cs, msg, sizeof(msg) - 1);
+	close_client(cs, end);
+	log_level = level;
+	ok = end == END_INTERNAL_ERROR &&
+	     memcmp(commands, &metrics->commands, sizeof(*commands)) == 0;
+	free(commands);
+	return !ok;
+}
+
+// Messages cut before their terminator. One longer than its state allows
+// is rejected at once, unless it can still be RECHARGING
+struct frame_case {
+	int state; // EXPECT_*
+	char* input;
+	int end; // SESSION_OPEN or END_*
+};
+
+struct frame_case frame_cases[] = {
+	{ EXPECT_KEY_ID, "1234", SESSION_OPEN },
+	{ EXPECT_KEY_ID, "123456", END_SYNTAX_ERROR },
+	{ EXPECT_KEY_ID, "RECHARGING\a", SESSION_OPEN },
+	{ EXPECT_KEY_ID, "RECHAX", END_SYNTAX_ERROR },
+	{ EXPECT_CONFIRMATION, "123456", SESSION_OPEN },
+	{ EXPECT_CONFIRMATION, "123456789", END_SYNTAX_ERROR },
+	{ EXPECT_CONFIRMATION, "RECHARG", SESSION_OPEN },
+	{ EXPECT_CLIENT_OK, "OK 123456789", END_SYNTAX_ERROR },
+};
+
+// Run frame_cases, input in one piece and byte by byte
+// return value:
+//     number of cases which end otherwise or without SERVER_SYNTAX_ERROR
+int bench_check_framing(void) {
+	struct frame_case* c;
+	struct client_state* cs;
+	int fails = 0;
+	int bytewise;
+	int end;
+	int len;
+	int i;
+	int j;
+
+	for (i = 0; i < (int)(sizeof(frame_cases) / sizeof(frame_cases[0])); i++) {
+		c = &frame_cases[i];
+		len = strlen(c->input);
+		for (bytewise = 0; bytewise < 2; bytewise++) {
+			cs = session_alloc();
+			if (cs == NULL) {
+				perror("malloc");
+				exit(EXIT_FAILURE);
 			}
-			client_states[fd].was_move = 1;
-			client_states[fd].state = EXPECT_CLIENT_OK;
-      
-			continue;		
-		}
-		if (client_states[fd].state == EXPECT_CLIENT_OK) {
-			// Client response to MOVE and ROTATE is recieved
-			int x;
-			int y;
-
-			if (!decode_client_ok(cmd, &x, &y)) {
-				// Not CLIENT_OK
-				rc = write(fd, SERVER_SYNTAX_ERROR, strlen(SERVER_SYNTAX_ERROR));
-				if (rc != strlen(SERVER_SYNTAX_ERROR)) {
-					close(fd);
-					FD_CLR(fd, fds);
-					return 0;
+			cs->fd = -1;
+			cs->state = c->state;
+			if (bytewise) {
+				end = SESSION_OPEN;
+				for (j = 0; j < len && end == SESSION_OPEN; j++) {
+					end = handle_client_data(cs, c->input + j, 1);
 				}
-				close(fd);
-				FD_CLR(fd, fds);
-				return 0;
+			} else {
+				end = handle_client_data(cs, c->input, len);
+			}
+			if (end != c->end ||
+			    (end == END_SYNTAX_ERROR &&
+			     (cs->outq_len == 0 ||
+			      strcmp(cs->buf->outq[cs->outq_len - 1].iov_base, SERVER_SYNTAX_ERROR) != 0))) {
+				fprintf(stderr, "framing differs on \"%s\" in state %d\n",
+					c->input, c->state);
+				fails++;
+			}
+			close_client(cs, end == SESSION_OPEN ? END_CLOSED : end);
+		}
+	}
+	return fails;
+}
+
+#define BENCH_HAS_TERMINATOR 0
+#define BENCH_DECODE_TEXT 1
+#define BENCH_DECODE_KEYID 2
+#define BENCH_DECODE_OK 3
+#define BENCH_GET_HASH 4
+
+struct bench_case {
+	char* name;
+	int function; // BENCH_*
+	char* msg; // message with "\a\b"
+};
+
+struct bench_case bench_cases[] = {
+	{ "has_terminator  OK reply", BENCH_HAS_TERMINATOR, "OK -3 12\a\b" },
+	{ "has_terminator  message", BENCH_HAS_TERMINATOR,
+	  "Tajne heslo: Ty nejsi robot, ty jsi prase, prase nebo robot, to je jedno\a\b" },
+	{ "has_terminator  \\a flood", BENCH_HAS_TERMINATOR,
+	  "\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\a\b" },
+	{ "has_terminator  \\b flood", BENCH_HAS_TERMINATOR,
+	  "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\a\b" },
+	{ "decode_text     username", BENCH_DECODE_TEXT, "Oompa Loompa\a\b" },
+	{ "decode_keyid    key id", BENCH_DECODE_KEYID, "3\a\b" },
+	{ "decode_keyid    confirmation", BENCH_DECODE_KEYID, "47364\a\b" },
+	{ "decode_keyid    long number", BENCH_DECODE_KEYID, "000000000000000000000000000001\a\b" },
+	{ "decode_ok       short", BENCH_DECODE_OK, "OK 1 -2\a\b" },
+	{ "decode_ok       long", BENCH_DECODE_OK, "OK -123456789 987654321\a\b" },
+	{ "decode_ok       garbage", BENCH_DECODE_OK, "OK 12x\a\b" },
+	{ "get_hash        username", BENCH_GET_HASH, "Oompa Loompa\a\b" },
+	{ "get_hash        20 chars", BENCH_GET_HASH, "abcdefghijklmnopqr\a\b" },
+};
+
+// Run parser self-check and benchmark
+// return value:
+//     0 if functions match references, 1 otherwise
+int bench(void) {
+	volatile int sink = 0;
+	struct bench_case* c;
+	char buf[BENCH_MSG_MAX];
+	long long start;
+	int fails;
+	int len;
+	int x;
+	int y;
+	int i;
+	unsigned int n;
+
+	fails = bench_check();
+	printf("self-check: %d inputs, %d differ\n", CHECK_ROUNDS, fails);
+	if (bench_check_framing() != 0) {
+		printf("self-check: framing of cut messages differs\n");
+		fails++;
+	}
+	if (bench_check_state() != 0) {
+		printf("self-check: session in unknown state is not confined\n");
+		fails++;
+	}
+
+	for (i = 0; i < (int)(sizeof(bench_cases) / sizeof(bench_cases[0])); i++) {
+		c = &bench_cases[i];
+		len = strlen(c->msg);
+		memcpy(buf, c->msg, len);
+		start = now_ns();
+		for (n = 0; n < BENCH_CALLS; n++) {
+			switch (c->function) {
+			case BENCH_HAS_TERMINATOR:
+				sink += has_terminator(buf, len);
+				break;
+			case BENCH_DECODE_TEXT:
+				sink += decode_client_text(len, CLIENTMSG_MAXLEN, &x);
+				break;
+			case BENCH_DECODE_KEYID:
+				sink += decode_client_keyid_confirm(buf, 65535, &x);
+				break;
+			case BENCH_DECODE_OK:
+				sink += decode_client_ok(buf, &x, &y);
+				break;
+			case BENCH_GET_HASH:
+				sink += get_hash(buf, len - 2);
+				break;
+			}
+			// keep the compiler from hoisting the call out of the loop
+			__asm__ volatile("" : : "r"(buf) : "memory");
+		}
+		printf("%-32s %6.2f ns/msg\n", c->name, (double)(now_ns() - start) / BENCH_CALLS);
+	}
+	return fails != 0;
+}
+
+/*
+ * Navigation benchmark (-N). Robots are dropped on random grids with
+ * obstacles, like those of loadgen, and driven through
+ * handle_client_data() in process: each command of the server is carried
+ * out on the grid and the position is reported back in "OK <x> <y>".
+ * Grids come from a seeded generator, so runs with the same seed are
+ * comparable. As every command is a round trip to the robot, commands per
+ * session are the score; they are set against the shortest path of a
+ * robot which knows the grid and its heading
+ */
+#define NAV_GRID 10 // robot starts within [-NAV_GRID, NAV_GRID], as with loadgen
+#define NAV_OBSTACLES 24 // at most, per grid
+#define NAV_SIDE (2 * NAV_GRID + 3) // grid and a free ring around it
+
+#define NAV_REACHED 0
+#define NAV_FAILED 1 // server closed the session or sent something else
+#define NAV_STUCK 2 // NAV_MAX_COMMANDS are spent and (0, 0) is not reached
+
+struct nav_grid {
+	int obstacles[NAV_OBSTACLES][2];
+	int nobstacles;
+	int x;
+	int y;
+	int d; // DIRECTION_*
+};
+
+_Bool nav_is_obstacle(struct nav_grid* g, int x, int y) {
+	int i;
+
+	for (i = 0; i < g->nobstacles; i++) {
+		if (g->obstacles[i][0] == x && g->obstacles[i][1] == y) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Index of state \x, \y, \d in nav_optimal() tables, -1 if off the grid
+// and its ring
+int nav_state(int x, int y, int d) {
+	if (x < -NAV_GRID - 1 || x > NAV_GRID + 1 || y < -NAV_GRID - 1 || y > NAV_GRID + 1) {
+		return -1;
+	}
+	return ((y + NAV_GRID + 1) * NAV_SIDE + x + NAV_GRID + 1) * 4 + d - DIRECTION_RIGHT;
+}
+
+__thread int nav_queue[NAV_SIDE * NAV_SIDE * 4];
+__thread short nav_dist[NAV_SIDE * NAV_SIDE * 4];
+
+// Breadth-first search over (x, y, direction). Obstacles are within the
+// grid, so going beyond its free ring never makes a path shorter
+// return value:
+//     fewest commands robot of \g needs to reach (0, 0), -1 if it is
+//     walled in
+int nav_optimal(struct nav_grid* g) {
+	int* queue = nav_queue;
+	short* dist = nav_dist;
+	int head = 0;
+	int tail = 0;
+	int next[3];
+	int x;
+	int y;
+	int d;
+	int s;
+	int i;
+
+	memset(dist, -1, sizeof(nav_dist));
+	s = nav_state(g->x, g->y, g->d);
+	dist[s] = 0;
+	queue[tail++] = s;
+	while (head < tail) {
+		s = queue[head++];
+		d = s % 4 + DIRECTION_RIGHT;
+		x = s / 4 % NAV_SIDE - NAV_GRID - 1;
+		y = s / 4 / NAV_SIDE - NAV_GRID - 1;
+		if (x == 0 && y == 0) {
+			return dist[s];
+		}
+		next[0] = nav_is_obstacle(g, x + dir_dx[d], y + dir_dy[d]) ? -1 :
+			  nav_state(x + dir_dx[d], y + dir_dy[d], d);
+		next[1] = nav_state(x, y, dir_left[d]);
+		next[2] = nav_state(x, y, dir_right[d]);
+		for (i = 0; i < 3; i++) {
+			if (next[i] != -1 && dist[next[i]] == -1) {
+				dist[next[i]] = dist[s] + 1;
+				queue[tail++] = next[i];
+			}
+		}
+	}
+	return -1;
+}
+
+// Random grid in \g with robot somewhere off (0, 0) which can reach it
+// return value:
+//     nav_optimal() of the grid
+int nav_grid_create(struct nav_grid* g) {
+	int optimal;
+	int n;
+	int x;
+	int y;
+
+	do {
+		g->nobstacles = 0;
+		n = bench_rand() % (NAV_OBSTACLES + 1);
+		while (g->nobstacles < n) {
+			x = (int)(bench_rand() % (2 * NAV_GRID + 1)) - NAV_GRID;
+			y = (int)(bench_rand() % (2 * NAV_GRID + 1)) - NAV_GRID;
+			if ((x != 0 || y != 0) && !nav_is_obstacle(g, x, y)) {
+				g->obstacles[g->nobstacles][0] = x;
+				g->obstacles[g->nobstacles][1] = y;
+				g->nobstacles++;
 			}
-			if (x == 0 && y == 0) {
-				// Target is reached
-				rc = write(fd, SERVER_PICK_UP, strlen(SERVER_PICK_UP));
-				if (rc != strlen(SERVER_PICK_UP)) {
-					close(fd);
-					FD_CLR(fd, fds);
-					return 0;
-				}
-				client_states[fd].state = EXPECT_CLIENT_MSG;
+		}
+		do {
+			g->x = (int)(bench_rand() % (2 * NAV_GRID + 1)) - NAV_GRID;
+			g->y = (int)(bench_rand() % (2 * NAV_GRID + 1)) - NAV_GRID;
+		} while ((g->x == 0 && g->y == 0) || nav_is_obstacle(g, g->x, g->y));
+		g->d = DIRECTION_RIGHT + bench_rand() % 4;
+		optimal = nav_optimal(g);
+	} while (optimal == -1);
+	return optimal;
+}
 
-				continue;
+// Drive robot of \g through the navigation part of a session, from the
+// first MOVE after login to LOGOUT. Time spent in handle_client_data()
+// on OK messages is added to \busy, their number to \decisions
+// return value:
+//     NAV_*, commands robot carried out in \commands
+int nav_session(struct nav_grid* g, int* commands, long long* busy, unsigned long long* decisions) {
+	struct client_state* cs;
+	char msg[48];
+	char* reply;
+	long long start;
+	int len;
+	int end;
+
+	cs = session_alloc();
+	if (cs == NULL) {
+		perror("session_alloc failed");
+		exit(EXIT_FAILURE);
+	}
+	// As handle_confirmation() leaves it
+	cs->fd = -1;
+	cs->x = X_UNKNOWN;
+	cs->y = Y_UNKNOWN;
+	cs->direction = DIRECTION_UNKNOWN;
+	cs->was_move = 1;
+	cs->state = EXPECT_CLIENT_OK;
+	budget_start(cs, EXPECT_CLIENT_OK);
+	reply = SERVER_MOVE;
+	*commands = 0;
+	while (1) {
+		if (strcmp(reply, SERVER_PICK_UP) == 0) {
+			// Only a logout can follow
+			len = snprintf(msg, sizeof(msg), "Secret message\a\b");
+			end = handle_client_data(cs, msg, len);
+			if (end == SESSION_OPEN) {
+				timer_cancel(cs);
+				session_free(cs);
+				return NAV_FAILED;
 			}
-			if (client_states[fd].x == X_UNKNOWN) {
-				// Position and orientation were unknown, now pos is known
-				client_states[fd].x = x;
-				client_states[fd].y = y;
-				rc = write(fd, SERVER_MOVE, strlen(SERVER_MOVE));
-				if (rc != strlen(SERVER_MOVE)){
-					close(fd);
-					FD_CLR(fd, fds);
-					return 0;
-				}
-				client_states[fd].was_move = 1;
-				// State remains EXPECT_CLIENT_OK
-				
-				continue;
+			close_client(cs, end);
+			return end == END_LOGOUT ? NAV_REACHED : NAV_FAILED;
+		}
+		if (*commands == NAV_MAX_COMMANDS) {
+			timer_cancel(cs);
+			session_free(cs);
+			return NAV_STUCK;
+		}
+		if (strcmp(reply, SERVER_MOVE) == 0) {
+			if (!nav_is_obstacle(g, g->x + dir_dx[g->d], g->y + dir_dy[g->d])) {
+				g->x += dir_dx[g->d];
+				g->y += dir_dy[g->d];
 			}
-			if (client_states[fd].direction == DIRECTION_UNKNOWN) {
-				// Position is known, orientation is not
-				if (client_states[fd].x == x && client_states[fd].y == y) {
-                                        // Move did not change position
-					if (client_states[fd].did_turn == 0) {
-						rc = write(fd, SERVER_TURN_RIGHT, strlen(SERVER_TURN_RIGHT));
-						if (rc != strlen(SERVER_TURN_RIGHT)) {
-							close(fd);
-							FD_CLR(fd, fds);
-							return 0;
-						}
-						client_states[fd].did_turn = 1;
-						client_states[fd].was_move = 0;
-					} else {
-						rc = write(fd, SERVER_MOVE, strlen(SERVER_MOVE));
-						if (rc != strlen(SERVER_MOVE)) {
-							close(fd);
-							FD_CLR(fd, fds);
-							return 0;
-						}
-						client_states[fd].was_move = 1;
-					}
-					
-					// State remains the same
-					continue;
-				}
-				if (client_states[fd].x == x) {
-					// Robot orientation is vertical
-					if (client_states[fd].y < y) {
-						// Direction is up
-						client_states[fd].direction = DIRECTION_UP;
-					} else {
-						// Direction is down
-						client_states[fd].direction = DIRECTION_DOWN;
-					}
-				}
-				if (client_states[fd].y == y) {
-					// Robot orientation is horizontal
-					if (client_states[fd].x < x) {
-						// Direction is right
-						client_states[fd].direction = DIRECTION_RIGHT;
-					} else {
-						// Direction is left
-						client_states[fd].direction = DIRECTION_LEFT;
-					}
-				}
+		} else if (strcmp(reply, SERVER_TURN_LEFT) == 0) {
+			g->d = dir_left[g->d];
+		} else if (strcmp(reply, SERVER_TURN_RIGHT) == 0) {
+			g->d = dir_right[g->d];
+		} else {
+			timer_cancel(cs);
+			session_free(cs);
+			return NAV_FAILED;
+		}
+		(*commands)++;
+		len = snprintf(msg, sizeof(msg), "OK %d %d\a\b", g->x, g->y);
+		start = now_ns();
+		end = handle_client_data(cs, msg, len);
+		if (end != SESSION_OPEN) {
+			close_client(cs, end);
+			return NAV_FAILED;
+		}
+		*busy += now_ns() - start;
+		(*decisions)++;
+		if (cs->outq_len != 1) {
+			timer_cancel(cs);
+			session_free(cs);
+			return NAV_FAILED;
+		}
+		reply = cs->buf->outq[0].iov_base;
+		cs->outq_len = 0;
+	}
+}
+
+int nav_cmp(const void* a, const void* b) {
+	return *(const int*)a - *(const int*)b;
+}
+
+// Run navigation benchmark on \ngrids grids generated from \seed
+// return value:
+//     0 if every robot reached (0, 0), 1 otherwise
+int nav_bench(int ngrids, unsigned int seed) {
+	unsigned long long decisions = 0;
+	unsigned long long total = 0;
+	unsigned long long optimal = 0;
+	struct nav_grid g;
+	long long busy = 0;
+	int reached = 0;
+	int failed = 0;
+	int stuck = 0;
+	int* counts;
+	int shortest;
+	int n;
+	int i;
+
+	counts = malloc(ngrids * sizeof(counts[0]));
+	if (counts == NULL) {
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	// xorshift never leaves 0
+	bench_rng = seed != 0 ? seed : 1;
+	for (i = 0; i < ngrids; i++) {
+		shortest = nav_grid_create(&g);
+		switch (nav_session(&g, &n, &busy, &decisions)) {
+		case NAV_REACHED:
+			counts[reached++] = n;
+			total += n;
+			optimal += shortest;
+			break;
+		case NAV_FAILED:
+			failed++;
+			fprintf(stderr, "grid %d: session failed after %d commands\n", i, n);
+			break;
+		case NAV_STUCK:
+			stuck++;
+			fprintf(stderr, "grid %d: (0, 0) not reached in %d commands\n", i, n);
+			break;
+		}
+	}
+	qsort(counts, reached, sizeof(counts[0]), nav_cmp);
+
+	printf("grids         %d, seed %u, up to %d obstacles within [-%d, %d]\n",
+	       ngrids, seed, NAV_OBSTACLES, NAV_GRID, NAV_GRID);
+	printf("reached       %d, %d failed (%.2f%%), %d stuck (%.2f%%)\n", reached,
+	       failed, 100.0 * failed / ngrids, stuck, 100.0 * stuck / ngrids);
+	if (reached != 0) {
+		printf("commands      %.2f per session, p50 %d, p90 %d, p99 %d, max %d\n",
+		       (double)total / reached, counts[(reached - 1) / 2],
+		       counts[(int)((reached - 1) * 0.9)], counts[(int)((reached - 1) * 0.99)],
+		       counts[reached - 1]);
+		printf("optimal       %.2f per session, %.1f%% more commands needed\n",
+		       (double)optimal / reached, optimal ? 100.0 * total / optimal - 100 : 0.0);
+	}
+	printf("decisions     %llu in %.3f s (%.0f/s)\n", decisions, busy / 1e9,
+	       busy ? decisions * 1e9 / busy : 0.0);
+	free(counts);
+	return failed + stuck != 0;
+}
+
+/*
+ * Virtual robots (-V). Every worker thread drives VIRTUAL_ROBOTS robots
+ * of its own through the protocol engine. They log in with a random key,
+ * navigate a random grid as in -N and hand over the message, taking turns
+ * message by message like connections of a busy worker. Nothing goes
+ * through the kernel, so sessions/sec measured is the ceiling the engine
+ * puts on the server. Metrics (-m), traces (-t) and spans (-T) are kept
+ * as for real robots
+ */
+#define VIRTUAL_ROBOTS 100 // per worker
+#define VIRTUAL_GRIDS 1024 // generated per worker in advance, robots reuse them
+
+// Virtual robot waits for
+#define VIRTUAL_KEY_REQUEST 0
+#define VIRTUAL_CONFIRMATION 1
+#define VIRTUAL_OK 2 // SERVER_OK, the first MOVE follows
+#define VIRTUAL_COMMAND 3
+#define VIRTUAL_LOGOUT 4
+#define VIRTUAL_DONE 5
+
+struct virtual_robot {
+	struct client_state* cs; // NULL if robot has no session
+	struct nav_grid grid;
+	int state; // VIRTUAL_*
+	int key_id;
+	int server_key;
+	int client_key;
+	int hash; // of its name
+	int commands;
+	int msg_len; // of msg, 0 if robot has nothing to send
+	char msg[32]; // to be sent
+};
+
+struct virtual_worker {
+	int id;
+	pthread_t thread;
+	long long nsessions; // to run
+	struct nav_grid* grids; // VIRTUAL_GRIDS
+	int keys[KEY_ID_MAX + 1]; // ids robots log in with
+	int nkeys;
+	unsigned long long done;
+	unsigned long long failed;
+	unsigned long long commands; // of sessions done
+};
+
+// Place robot \r of worker \w on a grid and open its session
+void virtual_start(struct virtual_worker* w, struct virtual_robot* r) {
+	struct key_table* t = atomic_load_explicit(&key_table, memory_order_acquire);
+	struct client_state* cs;
+	int len;
+
+	cs = session_alloc();
+	if (cs == NULL) {
+		perror("session_alloc failed");
+		exit(EXIT_FAILURE);
+	}
+	cs->fd = -1;
+	cs->state = EXPECT_USERNAME;
+	budget_start(cs, EXPECT_USERNAME);
+	metrics_session_start(cs);
+	trace_open(cs);
+	timer_arm(&session_timers, cs);
+	if (spans != NULL) {
+		span_open(cs);
+	}
+
+	r->grid = w->grids[bench_rand() % VIRTUAL_GRIDS];
+	r->cs = cs;
+	r->state = VIRTUAL_KEY_REQUEST;
+	r->key_id = w->keys[bench_rand() % w->nkeys];
+	r->server_key = t->keys[r->key_id].server_key;
+	r->client_key = t->keys[r->key_id].client_key;
+	r->commands = 0;
+	len = snprintf(r->msg, sizeof(r->msg), "robot%u", bench_rand());
+	r->hash = ref_get_hash(r->msg, len);
+	r->msg[len++] = '\a';
+	r->msg[len++] = '\b';
+	r->msg_len = len;
+}
+
+_Bool is_reply(char* msg, int len, char* reply) {
+	return len == (int)strlen(reply) && memcmp(msg, reply, len) == 0;
+}
+
+// Robot \r reads reply \msg of \len bytes, "\a\b" included
+// return value:
+//     0 if it is what robot expects, -1 otherwise
+int virtual_reply(struct virtual_robot* r, char* msg, int len) {
+	struct nav_grid* g = &r->grid;
+
+	switch (r->state) {
+	case VIRTUAL_KEY_REQUEST:
+		if (!is_reply(msg, len, SERVER_KEY_REQUEST)) {
+			return -1;
+		}
+		r->msg_len = snprintf(r->msg, sizeof(r->msg), "%d\a\b", r->key_id);
+		r->state = VIRTUAL_CONFIRMATION;
+		return 0;
+	case VIRTUAL_CONFIRMATION:
+		// atoi() stops at '\a'
+		if (atoi(msg) != (r->hash + r->server_key) % 65536) {
+			return -1;
+		}
+		r->msg_len = snprintf(r->msg, sizeof(r->msg), "%d\a\b",
+				      (r->hash + r->client_key) % 65536);
+		r->state = VIRTUAL_OK;
+		return 0;
+	case VIRTUAL_OK:
+		if (!is_reply(msg, len, SERVER_OK)) {
+			return -1;
+		}
+		r->state = VIRTUAL_COMMAND;
+		return 0;
+	case VIRTUAL_COMMAND:
+		if (is_reply(msg, len, SERVER_PICK_UP)) {
+			if (g->x != 0 || g->y != 0) {
+				return -1;
 			}
-			if (client_states[fd].x == x && client_states[fd].y == y &&
-			    client_states[fd].was_move && !client_states[fd].in_bypass) {
-				// Stuck on obstacle
-				
-				switch (client_states[fd].direction) {
-				case DIRECTION_RIGHT:
-					if (y > 0) {
-						start_bypass_turn_right(fd);
-					} else {
-						start_bypass_turn_left(fd);
-					}
-					break;
-				case DIRECTION_LEFT:
-					if (y > 0) {
-						start_bypass_turn_left(fd);
-					} else {
-						start_bypass_turn_right(fd);
-					}
-					break;
-				case DIRECTION_UP:
-					if (x > 0) {
-						start_bypass_turn_left(fd);
-					} else {
-						start_bypass_turn_right(fd);
-					}
-					break;
-				case DIRECTION_DOWN:
-					if (x > 0) {
-						start_bypass_turn_right(fd);
-					} else {
-						start_bypass_turn_left(fd);
-					}
-					break;
-				}
+			r->msg_len = snprintf(r->msg, sizeof(r->msg), "Secret message\a\b");
+			r->state = VIRTUAL_LOGOUT;
+			return 0;
+		}
+		if (++r->commands > NAV_MAX_COMMANDS) {
+			return -1;
+		}
+		if (is_reply(msg, len, SERVER_MOVE)) {
+			if (!nav_is_obstacle(g, g->x + dir_dx[g->d], g->y + dir_dy[g->d])) {
+				g->x += dir_dx[g->d];
+				g->y += dir_dy[g->d];
 			}
-			
-			// Update coordinates
-			client_states[fd].x = x;
-			client_states[fd].y = y;
-			if (client_states[fd].in_bypass) {
-				// Continue process of bypassing
-				char* c = client_states[fd].bypass_cmds[client_states[fd].bypass_cmd];
-				rc = write(fd, c, strlen(c));
-				if (rc != strlen(c)) {
-					close(fd);
-					FD_CLR(fd, fds);
-					return 0;
-				}
-				client_states[fd].bypass_cmd++;
-				if (client_states[fd].bypass_cmd == 8) {
-					client_states[fd].in_bypass = 0;
-					client_states[fd].was_move = 0;
-				}
+		} else if (is_reply(msg, len, SERVER_TURN_LEFT)) {
+			g->d = dir_left[g->d];
+		} else if (is_reply(msg, len, SERVER_TURN_RIGHT)) {
+			g->d = dir_right[g->d];
+		} else {
+			return -1;
+		}
+		r->msg_len = snprintf(r->msg, sizeof(r->msg), "OK %d %d\a\b", g->x, g->y);
+		return 0;
+	case VIRTUAL_LOGOUT:
+		if (!is_reply(msg, len, SERVER_LOGOUT)) {
+			return -1;
+		}
+		r->state = VIRTUAL_DONE;
+		return 0;
+	}
+	return -1;
+}
+
+// Robot \r of worker \w sends its message and reads the replies. Robot
+// which gets a reply it does not expect hangs up
+// return value:
+//     0 while the session goes on, 1 when it is over
+int virtual_step(struct virtual_worker* w, struct virtual_robot* r) {
+	struct client_state* cs = r->cs;
+	struct iovec* iov = cs->buf->outq;
+	int len = r->msg_len;
+	int end;
+	int i;
+
+	r->msg_len = 0;
+	end = handle_client_data(cs, r->msg, len);
+	for (i = 0; i < cs->outq_len; i++) {
+		if (virtual_reply(r, iov[i].iov_base, iov[i].iov_len) != 0) {
+			r->msg_len = 0;
+			break;
+		}
+	}
+	// Replies are taken by the robot
+	cs->outq_len = 0;
+	cs->outq_sent = 0;
+	if (end == SESSION_OPEN) {
+		if (r->msg_len != 0) {
+			return 0;
+		}
+		end = END_CLOSED;
+	}
+	close_client(cs, end);
+	r->cs = NULL;
+	if (end == END_LOGOUT && r->state == VIRTUAL_DONE) {
+		w->done++;
+		w->commands += r->commands;
+	} else {
+		w->failed++;
+	}
+	return 1;
+}
+
+void* virtual_worker_loop(void* arg) {
+	struct virtual_worker* w = arg;
+	struct virtual_robot* robots;
+	struct key_table* t;
+	long long started = 0;
+	int active = 0;
+	int i;
+
+	if (log_rings != NULL) {
+		log_ring = log_rings[w->id];
+	}
+	metrics = worker_metrics[w->id];
+	qsbr_slot = &qsbr_slots[w->id];
+	if (trace_path != NULL) {
+		trace = trace_create(trace_path, w->id);
+		if (trace == NULL) {
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (spans_path != NULL) {
+		spans = spans_create(spans_path, w->id);
+		if (spans == NULL) {
+			exit(EXIT_FAILURE);
+		}
+	}
+	robots = calloc(VIRTUAL_ROBOTS, sizeof(robots[0]));
+	w->grids = malloc(VIRTUAL_GRIDS * sizeof(w->grids[0]));
+	if (robots == NULL || w->grids == NULL) {
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	bench_rng = 2654435761u * (w->id + 1);
+	// Searching grids costs more than the sessions on them
+	for (i = 0; i < VIRTUAL_GRIDS; i++) {
+		nav_grid_create(&w->grids[i]);
+	}
+
+	qsbr_online();
+	// Robots log in with keys valid now. After a reload they may not be
+	t = atomic_load_explicit(&key_table, memory_order_acquire);
+	for (i = 0; i <= KEY_ID_MAX; i++) {
+		if (t->keys[i].valid) {
+			w->keys[w->nkeys++] = i;
+		}
+	}
+	if (w->nkeys == 0) {
+		fprintf(stderr, "no valid key to log in with\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < VIRTUAL_ROBOTS && started < w->nsessions; i++, started++) {
+		virtual_start(w, &robots[i]);
+		active++;
+	}
+	while (active > 0) {
+		// Quiescent state: robots keep key values, not the table
+		qsbr_online();
+		for (i = 0; i < VIRTUAL_ROBOTS; i++) {
+			if (robots[i].cs == NULL || virtual_step(w, &robots[i]) == 0) {
 				continue;
 			}
-			if (next_step(fd) != 0) {
-				close(fd);
-				FD_CLR(fd, fds);
-				return 0;
+			if (started < w->nsessions) {
+				virtual_start(w, &robots[i]);
+				started++;
+			} else {
+				active--;
 			}
-		
-			continue;
 		}
-		if (client_states[fd].state == EXPECT_CLIENT_MSG) {
-			int textlen;
+	}
+	qsbr_offline();
+	trace_sync();
+	spans_sync();
+	free(w->grids);
+	free(robots);
+	return NULL;
+}
 
-			if (!decode_client_text(cmd, cmd_len, CLIENTMSG_MAXLEN, &textlen)) {
-				// Not CLIENT_TEXT
-				close(fd);
-				FD_CLR(fd, fds);
-				return 0;
-			}
-			rc = write(fd, SERVER_LOGOUT, strlen(SERVER_LOGOUT));
-			if (rc != strlen(SERVER_LOGOUT)){
-				close(fd);
-				FD_CLR(fd, fds);
-				return 0;
+// Run \nsessions sessions of virtual robots on \nworkers workers
+// return value:
+//     0 if every session ended with logout, 1 otherwise
+int virtual_run(long long nsessions, int nworkers) {
+	struct virtual_worker* workers;
+	unsigned long long done = 0;
+	unsigned long long failed = 0;
+	unsigned long long commands = 0;
+	double elapsed;
+	long long start;
+	int rc;
+	int i;
+
+	workers = calloc(nworkers, sizeof(workers[0]));
+	if (workers == NULL) {
+		perror("calloc failed");
+		exit(EXIT_FAILURE);
+	}
+	start = now_ns();
+	for (i = 0; i < nworkers; i++) {
+		workers[i].id = i;
+		workers[i].nsessions = nsessions / nworkers + (i < nsessions % nworkers);
+		rc = pthread_create(&workers[i].thread, NULL, virtual_worker_loop, &workers[i]);
+		if (rc != 0) {
+			fprintf(stderr, "pthread_create failed: %s\n", strerror(rc));
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		done += workers[i].done;
+		failed += workers[i].failed;
+		commands += workers[i].commands;
+	}
+	elapsed = (now_ns() - start) / 1e9;
+
+	printf("sessions      %llu ok, %llu failed in %.3f s\n", done, failed, elapsed);
+	printf("sessions/sec  %.1f\n", done / elapsed);
+	printf("commands      %.2f per session\n", done ? (double)commands / done : 0.0);
+	free(workers);
+	return failed != 0;
+}
+
+// Records of one session of a trace being replayed
+struct trace_session {
+	unsigned int nrecords;
+	unsigned int first; // index in sorted record offsets
+};
+
+// Records follow data of any length, so they are not aligned: headers
+// are copied out, never read in place
+// return value:
+//     header of the record at \p
+struct trace_record trace_header(const char* p) {
+	struct trace_record r;
+
+	memcpy(&r, p, sizeof(r));
+	return r;
+}
+
+// return value:
+//     index of the first record which differs in \a and \b (arrays of
+//     \na and \nb record pointers), -1 if they are the same
+int trace_compare(char** a, int na, char** b, int nb) {
+	struct trace_record ra;
+	struct trace_record rb;
+	int i;
+
+	for (i = 0; i < na && i < nb; i++) {
+		ra = trace_header(a[i]);
+		rb = trace_header(b[i]);
+		if (ra.type != rb.type || ra.len != rb.len ||
+		    memcmp(a[i] + sizeof(ra), b[i] + sizeof(rb), ra.len) != 0) {
+			return i;
+		}
+	}
+	return na == nb ? -1 : i;
+}
+
+// Replay trace \path written by one worker. Input of every session is fed
+// through handle_client_data() as it was read, the trace the server
+// writes meanwhile is kept in memory and compared with the recorded one
+// except for times. Sessions are replayed one after another, at full
+// speed
+// return value:
+//     0 if every session matches, 1 otherwise
+int replay(char* path) {
+	unsigned int version = TRACE_VERSION;
+	struct trace_session* ts;
+	char** recs;
+	char** actual = NULL;
+	struct trace_record r;
+	struct client_state* cs;
+	unsigned long long inputs = 0;
+	unsigned int nsessions = 0;
+	unsigned int nrecs = 0;
+	unsigned int cap = 0;
+	unsigned int mismatches = 0;
+	unsigned int i;
+	unsigned int j;
+	size_t off;
+	struct stat st;
+	long long start;
+	char* base;
+	int live;
+	int end;
+	int n;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror(path);
+		return 1;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (st.st_size < 12 || base == MAP_FAILED || memcmp(base, TRACE_MAGIC, 8) != 0 ||
+	    memcmp(base + 8, &version, sizeof(version)) != 0) {
+		fprintf(stderr, "%s: not a trace\n", path);
+		return 1;
+	}
+
+	// Count records of every session, a record cut at the end is dropped
+	for (off = 12; off + sizeof(r) <= (size_t)st.st_size; off += sizeof(r) + r.len) {
+		r = trace_header(base + off);
+		if (off + sizeof(r) + r.len > (size_t)st.st_size) {
+			break;
+		}
+		if (r.session >= nsessions) {
+			nsessions = r.session + 1;
+		}
+		nrecs++;
+	}
+	ts = calloc(nsessions + 1, sizeof(*ts));
+	recs = malloc((nrecs + 1) * sizeof(*recs));
+	if (ts == NULL || recs == NULL) {
+		perror("malloc failed");
+		exit(EXIT_FAILURE);
+	}
+	for (off = 12, i = 0; i < nrecs; i++, off += sizeof(r) + r.len) {
+		r = trace_header(base + off);
+		ts[r.session].nrecords++;
+	}
+	// Group records by session keeping their order
+	for (i = 0, j = 0; i < nsessions; i++) {
+		ts[i].first = j;
+		j += ts[i].nrecords;
+		ts[i].nrecords = 0;
+	}
+	for (off = 12, i = 0; i < nrecs; i++, off += sizeof(r) + r.len) {
+		r = trace_header(base + off);
+		recs[ts[r.session].first + ts[r.session].nrecords++] = base + off;
+	}
+
+	trace = trace_create(NULL, 0);
+	if (trace == NULL) {
+		perror("trace_create failed");
+		exit(EXIT_FAILURE);
+	}
+	start = now_us();
+	for (i = 0; i < nsessions; i++) {
+		char** sr = recs + ts[i].first;
+
+		if (ts[i].nrecords == 0 || trace_header(sr[0]).type != TRACE_OPEN) {
+			continue;
+		}
+		cs = session_alloc();
+		if (cs == NULL) {
+			perror("session_alloc failed");
+			exit(EXIT_FAILURE);
+		}
+		cs->fd = -1;
+		cs->state = EXPECT_USERNAME;
+		budget_start(cs, EXPECT_USERNAME);
+		cs->buf->trace_id = i;
+		cs->buf->trace_since = now_us();
+		trace->len = 0;
+		live = 1;
+		for (j = 1; j < ts[i].nrecords && live; j++) {
+			r = trace_header(sr[j]);
+			if (r.type == TRACE_IN) {
+				inputs++;
+				end = handle_client_data(cs, sr[j] + sizeof(r), r.len);
+				if (end != SESSION_OPEN) {
+					close_client(cs, end);
+					live = 0;
+				} else {
+					flush_replies(cs);
+				}
+			} else if (r.type == TRACE_CLOSE) {
+				// robot closed connection or timed out
+				close_client(cs, *(unsigned char*)(sr[j] + sizeof(r)));
+				live = 0;
 			}
-			// Done with the the client
-			close(fd);
-			FD_CLR(fd, fds);
-			return 0;
+		}
+		if (live) {
+			// Trace ends while the session was still going on
+			timer_cancel(cs);
+			session_free(cs);
 		}
 
+		// Records written by the replay
+		n = 0;
+		for (off = 0; off < trace->len; off += sizeof(r) + r.len) {
+			r = trace_header(trace->buf + off);
+			if (n == (int)cap) {
+				cap = cap ? cap * 2 : 64;
+				actual = realloc(actual, cap * sizeof(*actual));
+				if (actual == NULL) {
+					perror("realloc failed");
+					exit(EXIT_FAILURE);
+				}
+			}
+			actual[n++] = trace->buf + off;
+		}
+		j = trace_compare(sr + 1, ts[i].nrecords - 1, actual, n);
+		if (j != (unsigned int)-1) {
+			mismatches++;
+			fprintf(stderr, "session %u differs at record %u\n", i, j + 1);
+		}
 	}
-	printf("Unreachable code\n");
-	exit(1);
+	start = now_us() - start;
+
+	printf("%u sessions, %u differ, %llu inputs in %.3f s (%.0f inputs/s)\n",
+	       nsessions, mismatches, inputs, start / 1e6,
+	       start ? inputs * 1e6 / start : 0.0);
+	free(actual);
+	free(recs);
+	free(ts);
+	munmap(base, st.st_size);
+	return mismatches != 0;
 }
 
+void usage(char* name)
+{
+	fprintf(stderr, "Usage: %s [-w workers] [-e engine] [-l level] [-m path]\n"
+		"       [-p port] [-u path]\n"
+		"       [-k keyfile] [-b backlog] [-c sessions] [-i sessions]\n"
+		"       [-t path] [-T path]\n"
+		"       [-H path] [-U path] [-P cpus]\n"
+		"       %s [-k keyfile] -R trace\n"
+		"       %s -B\n"
+		"       %s -N grids[:seed]\n"
+		"       %s [-w workers] [-k keyfile] [-m path] [-t path] [-T path]\n"
+		"          -V sessions\n"
+		"  -w workers  number of worker threads, 0 - one per CPU (default 1)\n"
+		"  -e engine   I/O engine: epoll or uring (default epoll). uring falls\n"
+		"              back to epoll if the kernel lacks support\n"
+		"  -l level    log level: off, error, warn, info, debug (default info)\n"
+		"              debug logs every message received\n"
+		"  -m path     serve metrics on unix socket path, a connection gets\n"
+		"              all of them in Prometheus text format\n"
+		"  -p port     TCP port robots connect to, 0 - none (default %d)\n"
+		"  -u path     accept robots on unix socket path too, for gateways\n"
+		"              on the same host. Not limited by -i\n"
+		"  -k keyfile  authentication keys, one \"<id> <server key> <client key>\"\n"
+		"              per line, id is 0-999. Reloaded on SIGHUP\n"
+		"  -b backlog  queue of pending connections (default %d)\n"
+		"  -c sessions admission limit: robots served at once, more are\n"
+		"              turned away (default 0 - no limit)\n"
+		"  -i sessions limit of robots served at once from one address by\n"
+		"              all workers together (default 0 - no limit)\n"
+		"  -t path     trace sessions of worker N to file path.N\n"
+		"  -T path     time steps of sessions of worker N, write them to\n"
+		"              path.N.json for Perfetto or chrome://tracing\n"
+		"  -R trace    replay sessions of trace without sockets, check that\n"
+		"              replies match and exit\n"
+		"  -B          check parsers against reference implementations on\n"
+		"              random inputs, benchmark them and exit\n"
+		"  -N grids    drive navigation through that many grids with random\n"
+		"              obstacles generated from seed (default 1), without\n"
+		"              sockets, report commands per session and exit\n"
+		"  -V sessions run sessions of virtual robots in process on the\n"
+		"              workers, report sessions/sec of the protocol engine\n"
+		"              and exit\n"
+		"  -H path     wait for a successor on unix socket path and hand\n"
+		"              listening sockets and sessions off to it\n"
+		"  -U path     take over from the server waiting on path with -H\n"
+		"              instead of binding the port, keeps its workers\n"
+		"  -P cpus     busy poll: worker N is pinned to the N-th CPU of list\n"
+		"              like 2-5,8 and spins instead of sleeping\n",
+		name, name, name, name, name, SERVER_PORT, LISTEN_BACKLOG);
+	exit(EXIT_FAILURE);
+}
 
-int main(void)
+int main(int argc, char* argv[])
 {
-	struct timeval timeout;
-	int socket_fd;
+	struct worker* workers;
+	char* metrics_path = NULL;
+	char* unix_path = NULL;
+	char* replay_path = NULL;
+	char* upgrade_path = NULL;
+	char* handoff = NULL;
+	int listeners[HANDOFF_MAX_FDS];
+	int cpus[CPU_SETSIZE];
+	int ncpus = 0;
+	int port = SERVER_PORT;
+	int unix_fd = -1;
+	int backlog = LISTEN_BACKLOG;
+	int max_sessions = 0;
+	int predecessor = -1;
+	long long virtual_sessions = 0;
+	unsigned int seed;
+	char* end;
+	int nworkers;
+	int opt;
 	int rc;
-	fd_set fds;
-	fd_set selectfds;
 	int i;
-	
 
-	socket_fd = start_connect_socket(5555);
-	
-	FD_ZERO(&fds);
-	/* initially fd set contains only connect socket */
-	FD_SET(socket_fd, &fds);
-	while (1) {
-		/* reinitialize selectfds with active sockets */
-		selectfds = fds;
-		/* wait until input arrives on sockets in selectfds set */
-		timeout.tv_sec = 1;
-		timeout.tv_usec = 0;
-		rc = select(FD_SETSIZE, &selectfds, NULL, NULL, &timeout);
-		if (rc == -1) {
-			perror("select failed");
-			return 1;
-		}
-		if (rc == 0) {
-			// Select timed out, close all connections except socket_fd
-			for (i = 0; i < FD_SETSIZE; i++) {
-				if (!FD_ISSET(i, &fds) || i == socket_fd) {
-					continue;
+	nworkers = 1;
+	while ((opt = getopt(argc, argv, "w:l:e:m:p:u:k:b:c:i:t:T:R:BN:V:H:U:P:")) != -1) {
+		switch (opt) {
+		case 'w':
+			nworkers = atoi(optarg);
+			if (nworkers < 0) {
+				usage(argv[0]);
+			}
+			if (nworkers == 0) {
+				nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+			}
+			break;
+		case 'e':
+			if (strcmp(optarg, "epoll") == 0) {
+				io_engine = ENGINE_EPOLL;
+			} else if (strcmp(optarg, "uring") == 0) {
+				io_engine = ENGINE_URING;
+			} else {
+				usage(argv[0]);
+			}
+			break;
+		case 'l':
+			for (i = LOG_OFF; i <= LOG_DEBUG; i++) {
+				if (strcasecmp(optarg, log_level_names[i]) == 0) {
+					break;
 				}
-				close(i);
-				FD_CLR(i, &fds);
 			}
-			continue;
+			if (i > LOG_DEBUG) {
+				usage(argv[0]);
+			}
+			log_level = i;
+			break;
+		case 'm':
+			metrics_path = optarg;
+			break;
+		case 'p':
+			port = strtol(optarg, &end, 10);
+			if (port < 0 || port > 65535 || *end != '\0') {
+				usage(argv[0]);
+			}
+			break;
+		case 'u':
+			unix_path = optarg;
+			break;
+		case 'k':
+			key_path = optarg;
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		case 'T':
+			spans_path = optarg;
+			break;
+		case 'R':
+			replay_path = optarg;
+			break;
+		case 'B':
+			return bench();
+		case 'N':
+			i = strtol(optarg, &end, 10);
+			seed = 1;
+			if (*end == ':') {
+				seed = strtoul(end + 1, &end, 10);
+			}
+			if (i < 1 || *end != '\0') {
+				usage(argv[0]);
+			}
+			return nav_bench(i, seed);
+		case 'V':
+			virtual_sessions = atoll(optarg);
+			if (virtual_sessions < 1) {
+				usage(argv[0]);
+			}
+			break;
+		case 'H':
+			handoff = optarg;
+			break;
+		case 'U':
+			upgrade_path = optarg;
+			break;
+		case 'P':
+			ncpus = parse_cpus(optarg, cpus, CPU_SETSIZE);
+			if (ncpus < 1) {
+				usage(argv[0]);
+			}
+			busy_poll = 1;
+			break;
+		case 'b':
+			backlog = atoi(optarg);
+			if (backlog < 1) {
+				usage(argv[0]);
+			}
+			break;
+		case 'c':
+			max_sessions = atoi(optarg);
+			if (max_sessions < 0) {
+				usage(argv[0]);
+			}
+			break;
+		case 'i':
+			max_per_peer = atoi(optarg);
+			if (max_per_peer < 0) {
+				usage(argv[0]);
+			}
+			break;
+		default:
+			usage(argv[0]);
 		}
+	}
 
-		/* check all sockets for which input is pending for processing */
-		for (i = 0; i < FD_SETSIZE; i++) {
-			if (!FD_ISSET (i, &selectfds))
-				continue;
-			
-			if (i == socket_fd) {
-				int fd;
-
-                                /* connect request */
-				fd = handle_connect(socket_fd);
-				FD_SET(fd, &fds);
-				// Initialize new client record
-				memset(&client_states[fd], 0, sizeof(client_states[fd]));
-				// Newly connected robot is to sent CLIENT_USERNAME
-				client_states[fd].state = EXPECT_USERNAME;
-				continue;
-			}
+	if (upgrade_path != NULL) {
+		// Listening sockets of the predecessor go to workers of the
+		// same number, so its worker count is taken over
+		predecessor = handoff_connect(upgrade_path, &nworkers, listeners, &unix_fd);
+	} else if (port == 0 && unix_path == NULL) {
+		fprintf(stderr, "-p 0 needs -u: robots have nowhere to connect\n");
+		exit(EXIT_FAILURE);
+	}
+	if (busy_poll && nworkers > ncpus) {
+		fprintf(stderr, "-P: %d workers need as many CPUs, %d given\n", nworkers, ncpus);
+		exit(EXIT_FAILURE);
+	}
+	// Kernel spreads connections evenly between SO_REUSEPORT listeners,
+	// so the limit is split evenly too. Per address limit is not, its
+	// table is shared
+	worker_max_sessions = (max_sessions + nworkers - 1) / nworkers;
 
-			// Process robot message from already connected robot
-			handle_client_msg(i, &fds);
+	raise_nofile_limit();
+	// First: SIGHUP has to be blocked before any thread is created
+	keys_init(nworkers);
+	if (replay_path != NULL) {
+		return replay(replay_path);
+	}
+	if (log_level != LOG_OFF) {
+		log_init(nworkers);
+	}
+	metrics_init(nworkers, metrics_path);
+	if (virtual_sessions != 0) {
+		return virtual_run(virtual_sessions, nworkers);
+	}
+
+	workers = calloc(nworkers, sizeof(workers[0]));
+	if (workers == NULL) {
+		perror("calloc failed");
+		exit(EXIT_FAILURE);
+	}
+	/* listening sockets are created in advance, so that bind failure is
+	 * reported before any worker starts */
+	if (predecessor == -1 && unix_path != NULL) {
+		unix_fd = start_unix_socket(unix_path, backlog);
+	}
+	for (i = 0; i < nworkers; i++) {
+		workers[i].id = i;
+		workers[i].wake_fd = -1;
+		workers[i].cpu = busy_poll ? cpus[i] : -1;
+		if (predecessor != -1) {
+			workers[i].socket_fd = listeners[i];
+		} else if (port != 0) {
+			workers[i].socket_fd = start_connect_socket(port, nworkers > 1, backlog);
+		} else {
+			workers[i].socket_fd = -1;
+		}
+		// Each worker closes its own unix listener on handoff
+		workers[i].unix_fd = unix_fd;
+		if (unix_fd != -1 && i != 0) {
+			workers[i].unix_fd = fcntl(unix_fd, F_DUPFD_CLOEXEC, 0);
+			if (workers[i].unix_fd == -1) {
+				perror("fcntl failed");
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (busy_poll && workers[i].socket_fd != -1) {
+			busy_poll_listener(workers[i].socket_fd, workers[i].cpu);
 		}
 	}
-	/* no way to get here */
-	close(socket_fd);
+	if (predecessor != -1) {
+		handoff_receive(predecessor, workers, nworkers);
+	}
+	if (handoff != NULL) {
+		handoff_listen(handoff, workers, nworkers);
+	}
+	for (i = 0; i < nworkers; i++) {
+		rc = pthread_create(&workers[i].thread, NULL, worker_loop, &workers[i]);
+		if (rc != 0) {
+			fprintf(stderr, "pthread_create failed: %s\n", strerror(rc));
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	free(workers);
+	/* workers return only after the successor took over */
+	log_text(LOG_INFO, -1, "handed off to successor, exiting");
 	return 0;
 }
-